@@ -0,0 +1,217 @@
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "ws.h"
+#include "bcast.h"
+
+#define LINE	64
+
+struct ws_bmsg {
+	long		refs;
+	int		txt;
+	size_t		n;
+	unsigned char	buf[];
+};
+
+/* The publisher writes head and the shard writes tail, each on its own
+ * cache line. */
+struct shard {
+	size_t		head;
+	size_t		lost;
+	char		pad0[LINE - 2 * sizeof(size_t)];
+	size_t		tail;
+	char		pad1[LINE - sizeof(size_t)];
+	ws_bmsg		**ring;
+	/* The same descriptor twice with eventfd. */
+	int		fd[2];
+};
+
+struct ws_bcast {
+	struct shard	*s;
+	int		n;
+	size_t		mask;
+};
+
+static void bmsg_put(ws_bmsg *m)
+{
+	if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(m);
+}
+
+static void release(void *arg, const void *buf)
+{
+	(void)buf;
+	bmsg_put(arg);
+}
+
+static int shard_init(struct shard *s, size_t slots)
+{
+#ifndef __linux__
+	int i, flags;
+#endif
+
+	if ((s->ring = calloc(slots, sizeof(*s->ring))) == NULL)
+		return -1;
+
+#ifdef __linux__
+	if ((s->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return -1;
+	s->fd[1] = s->fd[0];
+#else
+	if (pipe(s->fd) < 0)
+		return -1;
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl(s->fd[i], F_GETFL)) < 0 ||
+		    fcntl(s->fd[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+		    fcntl(s->fd[i], F_SETFD, FD_CLOEXEC) < 0)
+			return -1;
+#endif
+
+	return 0;
+}
+
+ws_bcast *ws_bcast_new(int shards, size_t slots)
+{
+	ws_bcast *b;
+	size_t n;
+	int i;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return NULL;
+	if ((b->s = calloc(shards, sizeof(*b->s))) == NULL) {
+		free(b);
+		return NULL;
+	}
+	for (i = 0; i < shards; i++)
+		b->s[i].fd[0] = b->s[i].fd[1] = -1;
+	b->n = shards;
+
+	for (n = 2; n < slots; n *= 2)
+		;
+	b->mask = n - 1;
+
+	for (i = 0; i < shards; i++)
+		if (shard_init(&b->s[i], n) < 0) {
+			ws_bcast_free(b);
+			return NULL;
+		}
+
+	return b;
+}
+
+void ws_bcast_free(ws_bcast *b)
+{
+	struct shard *s;
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		s = &b->s[i];
+		for (; s->ring && s->tail != s->head; s->tail++)
+			bmsg_put(s->ring[s->tail & b->mask]);
+		free(s->ring);
+		if (s->fd[0] >= 0)
+			close(s->fd[0]);
+		if (s->fd[1] != s->fd[0])
+			close(s->fd[1]);
+	}
+	free(b->s);
+	free(b);
+}
+
+int ws_bcast_publish(ws_bcast *b, int txt, const void *buf, size_t n)
+{
+	uint64_t one = 1;
+	struct shard *s;
+	size_t head, tail;
+	ws_bmsg *m;
+	int i, full = 0;
+
+	if ((m = malloc(sizeof(*m) + n)) == NULL)
+		return WS_E_QUEUE_LIMIT;
+	m->refs = 1;
+	m->txt = txt;
+	m->n = n;
+	if (n > 0)
+		memcpy(m->buf, buf, n);
+
+	for (i = 0; i < b->n; i++) {
+		s = &b->s[i];
+		head = s->head;
+		tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+		if (head - tail > b->mask) {
+			__atomic_add_fetch(&s->lost, 1, __ATOMIC_RELAXED);
+			full++;
+			continue;
+		}
+
+		__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+		s->ring[head & b->mask] = m;
+		__atomic_store_n(&s->head, head + 1, __ATOMIC_SEQ_CST);
+
+		/* Only a shard which may have seen its ring empty sleeps,
+		 * it reads tail after head (see ws_bcast_run()). */
+		if (__atomic_load_n(&s->tail, __ATOMIC_SEQ_CST) == head)
+			while (write(s->fd[1], &one, sizeof(one)) < 0 &&
+			       errno == EINTR)
+				;
+	}
+
+	bmsg_put(m);
+
+	return full;
+}
+
+int ws_bcast_fd(ws_bcast *b, int shard)
+{
+	return b->s[shard].fd[0];
+}
+
+int ws_bcast_run(ws_bcast *b, int shard,
+		 void (*each)(void *arg, ws_bmsg *m), void *arg)
+{
+	struct shard *s = &b->s[shard];
+	unsigned char buf[64];
+	size_t tail = s->tail;
+	ws_bmsg *m;
+	int cnt = 0;
+
+	while (read(s->fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	/* The batch ends when the ring is empty after the last store of
+	 * tail, otherwise the publisher didn't wake us up. */
+	while (tail != __atomic_load_n(&s->head, __ATOMIC_SEQ_CST)) {
+		m = s->ring[tail & b->mask];
+		each(arg, m);
+		bmsg_put(m);
+		__atomic_store_n(&s->tail, ++tail, __ATOMIC_SEQ_CST);
+		cnt++;
+	}
+
+	return cnt;
+}
+
+size_t ws_bcast_lost(ws_bcast *b, int shard)
+{
+	return __atomic_exchange_n(&b->s[shard].lost, 0, __ATOMIC_RELAXED);
+}
+
+ssize_t ws_bcast_queue(WebSocket *ws, ws_bmsg *m)
+{
+	ssize_t rc;
+
+	__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+	if ((rc = ws_queue_ref(ws, m->txt, m->buf, m->n, release, m)) <= 0)
+		bmsg_put(m);
+
+	return rc;
+}
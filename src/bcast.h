@@ -0,0 +1,42 @@
+#ifndef BCAST_H
+#define BCAST_H
+
+/* One publisher to the connections of many loops. A message is written
+ * once and referenced from a single-producer single-consumer ring per
+ * loop (a shard), each loop queues it to its own connections without
+ * copying it (see ws_queue_ref()). A ring which is full drops the
+ * message for its shard only: a slow shard loses messages, it never
+ * holds up the publisher or the other shards. */
+
+typedef struct ws_bcast ws_bcast;
+typedef struct ws_bmsg ws_bmsg;
+
+/* Rings of slots messages (rounded up to a power of 2). NULL in case of
+ * failure. */
+ws_bcast *ws_bcast_new(int shards, size_t slots);
+
+/* The shards' loops must be gone. */
+void ws_bcast_free(ws_bcast *b);
+
+/* The publisher's side, one thread at a time. Copies buf once, the
+ * number of shards which had no room for it or WS_E_QUEUE_LIMIT when
+ * out of memory. */
+int ws_bcast_publish(ws_bcast *b, int txt, const void *buf, size_t n);
+
+/* The shard's loop. Readable while messages are waiting. */
+int ws_bcast_fd(ws_bcast *b, int shard);
+
+/* Calls each(arg, m) for the messages published since the last call,
+ * in order, the loop passes m to ws_bcast_queue() for its connections
+ * and ws_flush()es them afterwards. The number of messages. */
+int ws_bcast_run(ws_bcast *b, int shard,
+		 void (*each)(void *arg, ws_bmsg *m), void *arg);
+
+/* Messages the shard lost since the last call because its ring was
+ * full, the loop may tell the clients to catch up some other way. */
+size_t ws_bcast_lost(ws_bcast *b, int shard);
+
+/* ws_queue_ref() of the shared payload. */
+ssize_t ws_bcast_queue(WebSocket *ws, ws_bmsg *m);
+
+#endif /* BCAST_H */
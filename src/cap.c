@@ -0,0 +1,169 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "ws.h"
+#include "cap.h"
+
+#define PAD(n)	(((n) + 7) & ~(size_t)7)
+
+struct ws_cap {
+	FILE		*f;
+	long long	t0;
+	/* Payload of the current frame left to record. */
+	uint64_t	left;
+	uint32_t	n;
+	int		err;
+};
+
+static long long now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+ws_cap *ws_cap_open(const char *path, int srv)
+{
+	struct ws_cap_hdr h;
+	ws_cap *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	if ((c->f = fopen(path, "wb")) == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, WS_CAP_MAGIC, sizeof(h.magic));
+	h.t0 = now_ns(CLOCK_REALTIME);
+	h.srv = !!srv;
+	c->t0 = now_ns(CLOCK_MONOTONIC);
+	if (fwrite(&h, sizeof(h), 1, c->f) != 1) {
+		fclose(c->f);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+int ws_cap_close(ws_cap *c)
+{
+	int err = c->err;
+
+	/* A frame cut short by the end of the session is filled up, the
+	 * records after it stay aligned. */
+	while (c->left > 0 && !err) {
+		if (fputc(0, c->f) == EOF)
+			err = 1;
+		c->left--;
+	}
+	if (!err && c->n % 8 && fwrite("\0\0\0\0\0\0\0", 8 - c->n % 8,
+				       1, c->f) != 1)
+		err = 1;
+	if (fclose(c->f))
+		err = 1;
+	free(c);
+
+	return err ? -1 : 0;
+}
+
+int ws_cap_frame(ws_cap *c, int conn, int dir, const ws_frame *f)
+{
+	struct ws_cap_rec r;
+	size_t n = f->n;
+
+	if (c->err)
+		return -1;
+
+	if (f->off == 0) {
+		memset(&r, 0, sizeof(r));
+		r.t = now_ns(CLOCK_MONOTONIC) - c->t0;
+		r.n = f->len > UINT32_MAX ? UINT32_MAX : f->len;
+		r.dir = dir;
+		r.b0 = f->fin << 7 | f->rsv << 4 | f->op;
+		r.conn = conn;
+		if (fwrite(&r, sizeof(r), 1, c->f) != 1)
+			goto err;
+		c->left = r.n;
+		c->n = r.n;
+	}
+
+	if (n > c->left)
+		n = c->left;
+	if (n > 0 && fwrite(f->buf, n, 1, c->f) != 1)
+		goto err;
+	c->left -= n;
+
+	if (f->off + f->n >= f->len) {
+		if (c->n % 8 && fwrite("\0\0\0\0\0\0\0", 8 - c->n % 8, 1,
+				       c->f) != 1)
+			goto err;
+		c->n = 0;
+	}
+
+	return 0;
+err:
+	c->err = 1;
+	return -1;
+}
+
+const struct ws_cap_hdr *ws_cap_map(const char *path, size_t *len)
+{
+	const struct ws_cap_hdr *h;
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	h = p;
+	if (memcmp(h->magic, WS_CAP_MAGIC, sizeof(h->magic))) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	*len = st.st_size;
+
+	return h;
+}
+
+void ws_cap_unmap(const struct ws_cap_hdr *h, size_t len)
+{
+	munmap((void *)h, len);
+}
+
+const struct ws_cap_rec *ws_cap_next(const struct ws_cap_hdr *h,
+				     size_t len, size_t *off)
+{
+	const struct ws_cap_rec *r;
+	size_t o = *off ? *off : sizeof(*h);
+
+	if (len - o < sizeof(*r))
+		return NULL;
+	r = (const void *)((const char *)h + o);
+	if (len - o - sizeof(*r) < PAD(r->n))
+		return NULL;
+	*off = o + sizeof(*r) + PAD(r->n);
+
+	return r;
+}
@@ -0,0 +1,54 @@
+#ifndef CAP_H
+#define CAP_H
+
+#include <stdint.h>
+
+/* A capture of WebSocket frames: a header and then the records, every
+ * one 8 byte aligned and followed by its payload (unmasked, padded up to
+ * 8 bytes), in host byte order. A reader walks the file's mapping in
+ * place. */
+
+#define WS_CAP_MAGIC	"WSCAP01"
+
+/* The direction of a frame as the recording side saw it. */
+#define WS_CAP_IN	0
+#define WS_CAP_OUT	1
+
+struct ws_cap_hdr {
+	char		magic[8];
+	uint64_t	t0;	/* CLOCK_REALTIME of the start, ns */
+	uint32_t	srv;	/* The recording side was a server. */
+	uint32_t	pad;
+};
+
+struct ws_cap_rec {
+	uint64_t	t;	/* ns since the start */
+	uint32_t	n;	/* Payloads over 4 GiB are cut. */
+	uint8_t		dir;
+	uint8_t		b0;	/* FIN, RSV and the opcode as on the wire */
+	uint16_t	conn;
+};
+
+typedef struct ws_cap ws_cap;
+
+/* NULL in case of failure. */
+ws_cap *ws_cap_open(const char *path, int srv);
+
+/* 0 in case of success or -1 if something wasn't written. */
+int ws_cap_close(ws_cap *c);
+
+/* Records f as ws_read_frame() returns it, the frame's time is when its
+ * first segment comes. 0 in case of success and -1 in case of failure. */
+int ws_cap_frame(ws_cap *c, int conn, int dir, const ws_frame *f);
+
+/* NULL in case of failure or if it's not a capture. */
+const struct ws_cap_hdr *ws_cap_map(const char *path, size_t *len);
+void ws_cap_unmap(const struct ws_cap_hdr *h, size_t len);
+
+/* The record at *off (0 for the first one) and moves *off past it, NULL
+ * at the end or if the record is truncated. The payload follows the
+ * record. */
+const struct ws_cap_rec *ws_cap_next(const struct ws_cap_hdr *h,
+				     size_t len, size_t *off);
+
+#endif /* CAP_H */
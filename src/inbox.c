@@ -0,0 +1,149 @@
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "ws.h"
+#include "inbox.h"
+
+struct imsg {
+	struct imsg	*next;
+	unsigned long	to;
+	int		txt;
+	size_t		n;
+	unsigned char	buf[];
+};
+
+struct ws_inbox {
+	/* The newest message first. */
+	struct imsg	*top;
+	/* The same descriptor twice with eventfd. */
+	int		fd[2];
+};
+
+ws_inbox *ws_inbox_new(void)
+{
+	ws_inbox *ib;
+#ifndef __linux__
+	int i, flags;
+#endif
+
+	if ((ib = calloc(1, sizeof(*ib))) == NULL)
+		return NULL;
+
+#ifdef __linux__
+	if ((ib->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		free(ib);
+		return NULL;
+	}
+	ib->fd[1] = ib->fd[0];
+#else
+	if (pipe(ib->fd) < 0) {
+		free(ib);
+		return NULL;
+	}
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl(ib->fd[i], F_GETFL)) < 0 ||
+		    fcntl(ib->fd[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+		    fcntl(ib->fd[i], F_SETFD, FD_CLOEXEC) < 0) {
+			ws_inbox_free(ib);
+			return NULL;
+		}
+#endif
+
+	return ib;
+}
+
+void ws_inbox_free(ws_inbox *ib)
+{
+	struct imsg *m;
+
+	while ((m = ib->top) != NULL) {
+		ib->top = m->next;
+		free(m);
+	}
+	close(ib->fd[0]);
+	if (ib->fd[1] != ib->fd[0])
+		close(ib->fd[1]);
+	free(ib);
+}
+
+int ws_inbox_fd(ws_inbox *ib)
+{
+	return ib->fd[0];
+}
+
+int ws_inbox_send(ws_inbox *ib, unsigned long to, int txt,
+		  const void *buf, size_t n)
+{
+	uint64_t one = 1;
+	struct imsg *m;
+
+	if ((m = malloc(sizeof(*m) + n)) == NULL)
+		return WS_E_QUEUE_LIMIT;
+	m->to = to;
+	m->txt = txt;
+	m->n = n;
+	if (n > 0)
+		memcpy(m->buf, buf, n);
+
+	m->next = __atomic_load_n(&ib->top, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ib->top, &m->next, m, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	/* Only the first message after the loop's turn wakes it up. An
+	 * eventfd counter never fills up, a full pipe is awake anyway. */
+	if (m->next == NULL)
+		while (write(ib->fd[1], &one, sizeof(one)) < 0 &&
+		       errno == EINTR)
+			;
+
+	return 0;
+}
+
+static void release(void *arg, const void *buf)
+{
+	(void)buf;
+	free(arg);
+}
+
+int ws_inbox_run(ws_inbox *ib,
+		 WebSocket *(*conn)(void *arg, unsigned long to), void *arg)
+{
+	struct imsg *m, *next, *head = NULL;
+	unsigned char buf[64];
+	WebSocket *ws;
+	int cnt = 0;
+
+	/* Woken up before taking the stack, a message pushed after it
+	 * wakes the next turn. */
+	while (read(ib->fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	m = __atomic_exchange_n(&ib->top, NULL, __ATOMIC_ACQUIRE);
+	for (; m; m = next) {
+		next = m->next;
+		m->next = head;
+		head = m;
+	}
+
+	for (m = head; m; m = next) {
+		next = m->next;
+		/* The queue frees it once it's sent. */
+		if ((ws = conn(arg, m->to)) != NULL &&
+		    ws_queue_ref(ws, m->txt, m->buf, m->n, release, m) > 0)
+			cnt++;
+		else
+			free(m);
+	}
+
+	return cnt;
+}
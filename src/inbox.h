@@ -0,0 +1,34 @@
+#ifndef INBOX_H
+#define INBOX_H
+
+/* Messages from any thread to the connections of a loop. The senders
+ * push to a lock-free stack and wake the loop up when it was empty, the
+ * loop takes everything pushed since its last turn at once and puts it
+ * to the connections' send queues in the order it was sent. A WebSocket
+ * itself stays the loop's: only ws_inbox_send() may be called from
+ * other threads. */
+
+typedef struct ws_inbox ws_inbox;
+
+/* NULL in case of failure. */
+ws_inbox *ws_inbox_new(void);
+
+/* Drops the messages left, the senders must be gone. */
+void ws_inbox_free(ws_inbox *ib);
+
+/* Readable while messages are waiting for ws_inbox_run(). */
+int ws_inbox_fd(ws_inbox *ib);
+
+/* Copies buf for the connection the loop knows as to. 0 in case of
+ * success or WS_E_QUEUE_LIMIT when out of memory. */
+int ws_inbox_send(ws_inbox *ib, unsigned long to, int txt,
+		  const void *buf, size_t n);
+
+/* Queues the messages with ws_queue_ref() to conn(arg, to), the loop
+ * notes there which connections to ws_flush(). A message to NULL (the
+ * connection is gone) or one the queue refuses is dropped. The number
+ * of queued messages. */
+int ws_inbox_run(ws_inbox *ib,
+		 WebSocket *(*conn)(void *arg, unsigned long to), void *arg);
+
+#endif /* INBOX_H */
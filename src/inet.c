@@ -1,18 +1,54 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <netdb.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "inet.h"
 
-int inet_connect(const char *proto,  const char *host,
-		 const char *port, int (*nonblock)(int))
+#define RACE_DELAY	250
+#define UNIX_PREFIX	"unix:"
+#define DNS_MAX		64
+
+/* A lookup shared by the races of the same name and cached till it
+ * expires. The entry is freed with its last reference. */
+struct inet_dns {
+	struct inet_dns	*next;
+	char		*proto;
+	char		*host;
+	char		*port;
+	struct addrinfo	*ai;
+	int		err;
+	int		done;
+	int		refs;
+	/* Readable once done, nobody drains it. */
+	int		fd[2];
+	long long	expires;
+};
+
+static struct inet_tune tune;
+static int tune_on;
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inet_dns *dns_cache;
+static int dns_n;
+static int dns_ttl = INET_DNS_TTL;
+
+static int hints(struct addrinfo *hint, const char *proto, int passive)
 {
-	struct addrinfo hint, *result, *iter;
-	int fd, rc, dgram, r_errno;
+	int dgram;
 
 	dgram = strcmp(proto, "udp") == 0 ? 1 :
 		strcmp(proto, "tcp") == 0 ? 0 : -1;
@@ -21,79 +57,701 @@ int inet_connect(const char *proto,  const char *host,
 		return -1;
 	}
 
-	memset(&hint, 0, sizeof(hint));
-	hint.ai_socktype = dgram ? SOCK_DGRAM : SOCK_STREAM;
-	hint.ai_family = AF_INET;
+	memset(hint, 0, sizeof(*hint));
+	hint->ai_socktype = dgram ? SOCK_DGRAM : SOCK_STREAM;
+	hint->ai_family = AF_UNSPEC;
+	hint->ai_flags = passive ? AI_PASSIVE : AI_ADDRCONFIG;
 
-	if (getaddrinfo(host, port, &hint, &result)) {
+	return dgram;
+}
+
+int inet_tune_profile(struct inet_tune *t, const char *name)
+{
+	if (strcmp(name, "latency") == 0) {
+		t->nodelay = 1;
+		t->quickack = 1;
+		/* Little unsent data, fresh writes don't queue behind it. */
+		t->notsent_lowat = 16384;
+	} else if (strcmp(name, "throughput") == 0) {
+		t->sndbuf = 4 << 20;
+		t->rcvbuf = 4 << 20;
+		t->cork = 1;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void inet_set_tune(const struct inet_tune *t)
+{
+	if ((tune_on = t != NULL))
+		tune = *t;
+}
+
+static int opt(int fd, int level, int name, int v)
+{
+	return setsockopt(fd, level, name, (void *)&v, sizeof(v));
+}
+
+int inet_tune(int fd, const struct inet_tune *t)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int type, tcp, rc = 0;
+
+	if (!t && !tune_on)
+		return 0;
+	t = t ? t : &tune;
+
+	len = sizeof(ss);
+	if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0)
+		return -1;
+	len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return -1;
+	tcp = type == SOCK_STREAM &&
+	      (ss.ss_family == AF_INET || ss.ss_family == AF_INET6);
+
+	/* Before connect() or listen() the buffers set the window scale. */
+	if (t->sndbuf && opt(fd, SOL_SOCKET, SO_SNDBUF, t->sndbuf) < 0)
+		rc = -1;
+	if (t->rcvbuf && opt(fd, SOL_SOCKET, SO_RCVBUF, t->rcvbuf) < 0)
+		rc = -1;
+	if (t->keepalive && type == SOCK_STREAM &&
+	    opt(fd, SOL_SOCKET, SO_KEEPALIVE, 1) < 0)
+		rc = -1;
+	if (!tcp)
+		return rc;
+
+	if (t->nodelay && opt(fd, IPPROTO_TCP, TCP_NODELAY, 1) < 0)
+		rc = -1;
+#ifdef TCP_QUICKACK
+	if (t->quickack && opt(fd, IPPROTO_TCP, TCP_QUICKACK, 1) < 0)
+		rc = -1;
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	if (t->notsent_lowat && opt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+					t->notsent_lowat) < 0)
+		rc = -1;
+#endif
+#if defined(TCP_KEEPIDLE)
+	if (t->keepalive && opt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+					t->keepalive) < 0)
+		rc = -1;
+#elif defined(TCP_KEEPALIVE)
+	if (t->keepalive && opt(fd, IPPROTO_TCP, TCP_KEEPALIVE,
+					t->keepalive) < 0)
+		rc = -1;
+#endif
+#ifdef TCP_USER_TIMEOUT
+	if (t->user_timeout && opt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+					t->user_timeout) < 0)
+		rc = -1;
+#endif
+
+	return rc;
+}
+
+static int is_tcp(struct addrinfo *ai)
+{
+	return ai->ai_socktype == SOCK_STREAM &&
+	       (ai->ai_family == AF_INET || ai->ai_family == AF_INET6);
+}
+
+static void tune_connect(int fd, struct addrinfo *ai)
+{
+	if (!tune_on)
+		return;
+
+	inet_tune(fd, &tune);
+#ifdef TCP_FASTOPEN_CONNECT
+	if (tune.fastopen && is_tcp(ai))
+		opt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#else
+	(void)ai;
+#endif
+}
+
+static void tune_listen(int fd, struct addrinfo *ai)
+{
+	if (!tune_on)
+		return;
+
+	inet_tune(fd, &tune);
+	if (!is_tcp(ai))
+		return;
+#ifdef TCP_FASTOPEN
+	if (tune.fastopen)
+		opt(fd, IPPROTO_TCP, TCP_FASTOPEN, tune.fastopen);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	/* Wake accept() only when the request is there. */
+	if (tune.defer_accept)
+		opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tune.defer_accept);
+#endif
+}
+
+int inet_cork(int fd, int on)
+{
+	if (!tune_on || !tune.cork)
+		return 0;
+#ifdef TCP_CORK
+	return opt(fd, IPPROTO_TCP, TCP_CORK, on);
+#else
+	(void)fd;
+	(void)on;
+	return 0;
+#endif
+}
+
+static int is_unix(const char *host)
+{
+	return host && strncmp(host, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0;
+}
+
+/* unix:/path or unix:@name (abstract) as a one entry addrinfo list. */
+static struct addrinfo *unix_ai(const char *host, int dgram)
+{
+	struct {
+		struct addrinfo		ai;
+		struct sockaddr_un	un;
+	} *u;
+	const char *path = host + sizeof(UNIX_PREFIX) - 1;
+	size_t len = strlen(path);
+
+	if (len == 0 || len >= sizeof(u->un.sun_path)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		return NULL;
+
+	u->un.sun_family = AF_UNIX;
+	memcpy(u->un.sun_path, path, len);
+	/* An abstract name starts with a NUL byte and isn't terminated. */
+	if (path[0] == '@')
+		u->un.sun_path[0] = 0;
+
+	u->ai.ai_family = AF_UNIX;
+	u->ai.ai_socktype = dgram ? SOCK_DGRAM : SOCK_STREAM;
+	u->ai.ai_addr = (struct sockaddr *)&u->un;
+	u->ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len +
+			   (path[0] != '@');
+
+	return &u->ai;
+}
+
+static void ai_free(struct addrinfo *ai)
+{
+	if (ai->ai_family == AF_UNIX)
+		free(ai);
+	else
+		freeaddrinfo(ai);
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Alternate the families keeping the resolver's order within each. */
+static struct addrinfo *interleave(struct addrinfo *ai)
+{
+	struct addrinfo *a = NULL, **at = &a, *b = NULL, **bt = &b;
+	struct addrinfo *head = NULL, **t = &head;
+	int fam = ai ? ai->ai_family : 0;
+
+	for (; ai; ai = ai->ai_next) {
+		if (ai->ai_family == fam) {
+			*at = ai;
+			at = &ai->ai_next;
+		} else {
+			*bt = ai;
+			bt = &ai->ai_next;
+		}
+	}
+	*at = *bt = NULL;
+
+	while (a || b) {
+		if (a) {
+			*t = a;
+			t = &a->ai_next;
+			a = a->ai_next;
+		}
+		if (b) {
+			*t = b;
+			t = &b->ai_next;
+			b = b->ai_next;
+		}
+	}
+	*t = NULL;
+
+	return head;
+}
+
+static void dns_free(struct inet_dns *e)
+{
+	close(e->fd[0]);
+	close(e->fd[1]);
+	if (e->ai)
+		freeaddrinfo(e->ai);
+	free(e);
+}
+
+static void dns_put(struct inet_dns *e)
+{
+	int last;
+
+	pthread_mutex_lock(&dns_lock);
+	last = --e->refs == 0;
+	pthread_mutex_unlock(&dns_lock);
+
+	if (last)
+		dns_free(e);
+}
+
+/* Called with dns_lock held. */
+static void dns_unlink(struct inet_dns **p)
+{
+	struct inet_dns *e = *p;
+
+	*p = e->next;
+	dns_n--;
+	if (--e->refs == 0)
+		dns_free(e);
+}
+
+static void *dns_run(void *arg)
+{
+	struct inet_dns *e = arg;
+	struct addrinfo hint, *ai;
+	int err = 0;
+
+	hints(&hint, e->proto, 0);
+	if (getaddrinfo(e->host, e->port, &hint, &ai)) {
+		ai = NULL;
+		err = EINVAL;
+	}
+
+	pthread_mutex_lock(&dns_lock);
+	e->ai = interleave(ai);
+	e->err = err;
+	e->done = 1;
+	/* Failures aren't cached. */
+	e->expires = now_ms() + (err ? 0 : dns_ttl);
+	pthread_mutex_unlock(&dns_lock);
+
+	while (write(e->fd[1], "", 1) < 0 && errno == EINTR)
+		;
+	dns_put(e);
+
+	return NULL;
+}
+
+static int streq(const char *a, const char *b)
+{
+	return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
+static struct inet_dns *dns_new(const char *proto, const char *host,
+				const char *port)
+{
+	size_t lp = strlen(proto) + 1, lh = host ? strlen(host) + 1 : 0;
+	size_t ls = port ? strlen(port) + 1 : 0;
+	struct inet_dns *e;
+	char *p;
+
+	if ((e = calloc(1, sizeof(*e) + lp + lh + ls)) == NULL)
+		return NULL;
+
+	p = (char *)(e + 1);
+	e->proto = strcpy(p, proto);
+	e->host = host ? strcpy(p + lp, host) : NULL;
+	e->port = port ? strcpy(p + lp + lh, port) : NULL;
+
+	if (pipe(e->fd) < 0) {
+		free(e);
+		return NULL;
+	}
+	fcntl(e->fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(e->fd[1], F_SETFD, FD_CLOEXEC);
+
+	return e;
+}
+
+/* A referenced lookup of the name, a new one starts in its own thread. */
+static struct inet_dns *dns_get(const char *proto, const char *host,
+				const char *port)
+{
+	struct inet_dns *e, **p;
+	sigset_t all, old;
+	pthread_t t;
+	long long now = now_ms();
+	int rc;
+
+	pthread_mutex_lock(&dns_lock);
+	for (p = &dns_cache; (e = *p) != NULL; ) {
+		if (e->done && e->expires <= now) {
+			dns_unlink(p);
+		} else if (streq(e->proto, proto) && streq(e->host, host) &&
+			   streq(e->port, port)) {
+			e->refs++;
+			pthread_mutex_unlock(&dns_lock);
+			return e;
+		} else
+			p = &e->next;
+	}
+
+	if ((e = dns_new(proto, host, port)) == NULL) {
+		pthread_mutex_unlock(&dns_lock);
+		return NULL;
+	}
+
+	/* The thread must not take the process' signals. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&t, NULL, dns_run, e);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		pthread_mutex_unlock(&dns_lock);
+		dns_free(e);
+		errno = rc;
+		return NULL;
+	}
+	pthread_detach(t);
+
+	/* The oldest one goes when the cache is full. */
+	if (dns_n >= DNS_MAX) {
+		for (p = &dns_cache; (*p)->next; p = &(*p)->next)
+			;
+		dns_unlink(p);
+	}
+
+	/* The cache, the thread and the caller. */
+	e->refs = 3;
+	e->next = dns_cache;
+	dns_cache = e;
+	dns_n++;
+	pthread_mutex_unlock(&dns_lock);
+
+	return e;
+}
+
+void inet_dns_ttl(int ms)
+{
+	pthread_mutex_lock(&dns_lock);
+	dns_ttl = ms;
+	pthread_mutex_unlock(&dns_lock);
+}
+
+/* 0 once the addresses are known, -1 with errno EINPROGRESS before. */
+static int race_dns(struct inet_race *r)
+{
+	int done, err;
+
+	if (r->ai || !r->dns)
+		return 0;
+
+	pthread_mutex_lock(&dns_lock);
+	done = r->dns->done;
+	err = r->dns->err;
+	pthread_mutex_unlock(&dns_lock);
+
+	if (!done || err) {
+		errno = done ? err : EINPROGRESS;
+		return -1;
+	}
+
+	r->next = r->ai = r->dns->ai;
+	return 0;
+}
+
+int inet_race_start(struct inet_race *r, const char *proto,
+		    const char *host, const char *port)
+{
+	struct addrinfo hint;
+	int dgram;
+
+	memset(r, 0, sizeof(*r));
+	if ((dgram = hints(&hint, proto, 0)) < 0)
+		return -1;
+
+	if (is_unix(host))
+		return (r->next = r->ai = unix_ai(host, dgram)) ? 0 : -1;
+
+	/* Literals need no lookup. */
+	hint.ai_flags |= AI_NUMERICHOST;
+	if (getaddrinfo(host, port, &hint, &r->ai) == 0) {
+		r->next = r->ai = interleave(r->ai);
+		return 0;
+	}
+	r->ai = NULL;
+
+	if ((r->dns = dns_get(proto, host, port)) == NULL)
+		return -1;
+	if (race_dns(r) < 0 && errno != EINPROGRESS) {
+		inet_race_end(r);
 		errno = EINVAL;
 		return -1;
 	}
 
-	for (iter = result; iter != NULL; iter = iter->ai_next) {
-		if ((fd = socket(iter->ai_family, iter->ai_socktype,
-				 iter->ai_protocol)) < 0)
+	return 0;
+}
+
+static int race_won(struct inet_race *r, int i)
+{
+	int fd = r->fd[i];
+
+	r->fd[i] = r->fd[--r->n];
+	return fd;
+}
+
+static void race_lost(struct inet_race *r, int i, int err)
+{
+	close(r->fd[i]);
+	r->fd[i] = r->fd[--r->n];
+	r->err = err;
+	/* A failed attempt lets the next one start right away. */
+	r->t_next = 0;
+}
+
+int inet_race_step(struct inet_race *r)
+{
+	struct pollfd fds[INET_RACE_MAX];
+	struct addrinfo *ai;
+	socklen_t len;
+	int i, fd, err, flags;
+
+	if (race_dns(r) < 0)
+		return -1;
+
+	for (i = 0; i < r->n; i++) {
+		fds[i].fd = r->fd[i];
+		fds[i].events = POLLOUT;
+	}
+	if (r->n > 0 && poll(fds, r->n, 0) > 0) {
+		for (i = r->n - 1; i >= 0; i--) {
+			if (!fds[i].revents)
+				continue;
+			len = sizeof(err);
+			if (getsockopt(r->fd[i], SOL_SOCKET, SO_ERROR,
+							&err, &len) < 0)
+				err = errno;
+			if (!err)
+				return race_won(r, i);
+			race_lost(r, i, err);
+		}
+	}
+
+	while (r->next && r->n < INET_RACE_MAX &&
+	       (r->n == 0 || now_ms() >= r->t_next)) {
+		ai = r->next;
+		r->next = ai->ai_next;
+
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol)) < 0) {
+			r->err = errno;
 			continue;
-		if (nonblock && nonblock(fd) < 0) {
+		}
+		if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+		    fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			r->err = errno;
 			close(fd);
 			continue;
 		}
-		rc = connect(fd, iter->ai_addr, iter->ai_addrlen);
-		if (rc == 0 || (rc < 0 && nonblock && errno == EINPROGRESS))
+
+		/* Tuning is a hint, a refused option doesn't fail the race. */
+		tune_connect(fd, ai);
+		r->fd[r->n++] = fd;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			return race_won(r, r->n - 1);
+		if (errno != EINPROGRESS) {
+			race_lost(r, r->n - 1, errno);
+			continue;
+		}
+		r->t_next = now_ms() + RACE_DELAY;
+	}
+
+	errno = r->n > 0 || r->next ? EINPROGRESS :
+		r->err ? r->err : EINVAL;
+	return -1;
+}
+
+int inet_race_fds(struct inet_race *r, struct pollfd *fds, int *tmo)
+{
+	long long t;
+	int i;
+
+	*tmo = -1;
+	if (r->dns && !r->ai) {
+		fds[0].fd = r->dns->fd[0];
+		fds[0].events = POLLIN;
+		return 1;
+	}
+
+	for (i = 0; i < r->n; i++) {
+		fds[i].fd = r->fd[i];
+		fds[i].events = POLLOUT;
+	}
+
+	if (r->next) {
+		t = r->t_next - now_ms();
+		*tmo = t > 0 ? (int)t : 0;
+	}
+
+	return r->n;
+}
+
+void inet_race_end(struct inet_race *r)
+{
+	while (r->n > 0)
+		close(r->fd[--r->n]);
+	if (r->dns)
+		dns_put(r->dns);
+	else if (r->ai)
+		ai_free(r->ai);
+	memset(r, 0, sizeof(*r));
+}
+
+int inet_connect(const char *proto,  const char *host,
+		 const char *port, int (*nonblock)(int))
+{
+	struct pollfd fds[INET_RACE_MAX];
+	struct inet_race r;
+	int fd, n, tmo, r_errno, flags;
+
+	if (inet_race_start(&r, proto, host, port) < 0)
+		return -1;
+
+	while ((fd = inet_race_step(&r)) < 0 && errno == EINPROGRESS) {
+		n = inet_race_fds(&r, fds, &tmo);
+		if (poll(fds, n, tmo) < 0 && errno != EINTR)
 			break;
-		close(fd);
 	}
-	/* Clumsy way to set errno. */
+
 	r_errno = errno;
-	if (iter == NULL && !errno)
-		r_errno = EINVAL;
-	freeaddrinfo(result);
+	inet_race_end(&r);
+
+	/* The race runs on non-blocking sockets. */
+	if (fd >= 0 && (nonblock ? nonblock(fd) :
+	    ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	     fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0))) {
+		r_errno = errno;
+		close(fd);
+		fd = -1;
+	}
+
 	errno = r_errno;
-	return iter == NULL ? -1 : fd;
+	return fd;
 }
 
-int inet_listen(const char *proto, const char *host, const char *port)
+static int listen_one(struct addrinfo *ai, int dgram)
 {
-	struct addrinfo hint, *result, *iter;
-	int fd, reuse = 1, dgram, r_errno;
+	int fd, reuse = 1, v6only = 0;
 
-	dgram = strcmp(proto, "udp") == 0 ? 1 :
-		strcmp(proto, "tcp") == 0 ? 0 : -1;
-	if (dgram < 0) {
-		errno = EINVAL;
+	if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			 ai->ai_protocol)) < 0)
+		return -1;
+	if (!dgram && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				(void *)&reuse, sizeof(reuse)) < 0)
+		goto err;
+	/* The IPv6 wildcard takes IPv4 too. */
+	if (ai->ai_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6,
+			IPV6_V6ONLY, (void *)&v6only, sizeof(v6only)) < 0)
+		goto err;
+	/* Mostly inherited by the accepted sockets. */
+	tune_listen(fd, ai);
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+		goto err;
+	if (!dgram && listen(fd, SOMAXCONN) < 0)
+		goto err;
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+/* A socket file nobody listens on is left from a previous run. */
+static void unix_stale(struct addrinfo *ai)
+{
+	struct sockaddr_un *un = (struct sockaddr_un *)ai->ai_addr;
+	int fd;
+
+	if (un->sun_path[0] == 0 ||
+	    (fd = socket(AF_UNIX, ai->ai_socktype, 0)) < 0)
+		return;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+	    errno == ECONNREFUSED)
+		unlink(un->sun_path);
+	close(fd);
+}
+
+static int listen_unix(const char *host, int dgram, int *fds, int n)
+{
+	struct addrinfo *ai;
+	int fd, r_errno;
+
+	if (n < 1 || (ai = unix_ai(host, dgram)) == NULL)
+		return -1;
+
+	unix_stale(ai);
+	fd = listen_one(ai, dgram);
+	r_errno = errno;
+	ai_free(ai);
+
+	if (fd < 0) {
+		errno = r_errno;
 		return -1;
 	}
+	fds[0] = fd;
+	return 1;
+}
 
-	memset(&hint, 0, sizeof(hint));
-	hint.ai_socktype = dgram ? SOCK_DGRAM : SOCK_STREAM;
-	hint.ai_family = AF_INET;
-	hint.ai_flags = AI_PASSIVE;
+int inet_listen_all(const char *proto, const char *host, const char *port,
+		    int *fds, int n)
+{
+	struct addrinfo hint, *result, *iter;
+	int fd, dgram, r_errno = 0, cnt = 0;
+
+	if ((dgram = hints(&hint, proto, 1)) < 0)
+		return -1;
+
+	if (is_unix(host))
+		return listen_unix(host, dgram, fds, n);
 
 	if (getaddrinfo(host, port, &hint, &result)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	for (iter = result; iter != NULL; iter = iter->ai_next) {
-		if ((fd = socket(iter->ai_family, iter->ai_socktype,
-				 iter->ai_protocol)) < 0)
-			continue;
-		if (!dgram && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
-					(void *)&reuse, sizeof(reuse)) < 0)
-			goto err;
-		if (bind(fd, iter->ai_addr, iter->ai_addrlen) < 0)
-			goto err;
-		if (!dgram && listen(fd, SOMAXCONN) < 0)
-			goto err;
-		break;
-err:
-		close(fd);
-	}
-	r_errno = errno;
-	if (iter == NULL && !errno)
-		r_errno = EINVAL;
+	/* IPv6 first, a dual-stack wildcard makes IPv4 one busy. */
+	for (iter = result; iter != NULL && cnt < n; iter = iter->ai_next)
+		if (iter->ai_family == AF_INET6 &&
+		    (fd = listen_one(iter, dgram)) >= 0)
+			fds[cnt++] = fd;
+		else if (iter->ai_family == AF_INET6)
+			r_errno = errno;
+	for (iter = result; iter != NULL && cnt < n; iter = iter->ai_next)
+		if (iter->ai_family != AF_INET6 &&
+		    (fd = listen_one(iter, dgram)) >= 0)
+			fds[cnt++] = fd;
+		else if (iter->ai_family != AF_INET6 && errno != EADDRINUSE)
+			r_errno = errno;
+
 	freeaddrinfo(result);
-	errno = r_errno;
-	return iter == NULL ? -1 : fd;
+	errno = r_errno ? r_errno : EINVAL;
+	return cnt > 0 ? cnt : -1;
 }
 
+int inet_listen(const char *proto, const char *host, const char *port)
+{
+	int fd;
+
+	return inet_listen_all(proto, host, port, &fd, 1) < 0 ? -1 : fd;
+}
@@ -1,14 +1,97 @@
 #ifndef INET_H
 #define INET_H
 
+#include <poll.h>
+
+struct addrinfo;
+struct inet_dns;
+
+/* Simultaneous connection attempts of a race. */
+#define INET_RACE_MAX	8
+
+/* How long resolved names are cached by default, in ms. */
+#define INET_DNS_TTL	30000
+
+/* A Happy Eyeballs (RFC 8305) connect: the resolved addresses alternate
+ * between the families and a new attempt starts every 250 ms or as soon
+ * as the previous one fails, the first connected socket wins. The name
+ * is resolved in the background unless it's cached or a literal. */
+struct inet_race {
+	struct inet_dns	*dns;
+	struct addrinfo	*ai;
+	struct addrinfo	*next;
+	int		fd[INET_RACE_MAX];
+	int		n;
+	long long	t_next;
+	int		err;
+};
+
+/* Socket tuning, 0 leaves an option as it is. */
+struct inet_tune {
+	int	nodelay;	/* TCP_NODELAY */
+	int	quickack;	/* TCP_QUICKACK, the kernel may drop it */
+	int	notsent_lowat;	/* TCP_NOTSENT_LOWAT, bytes */
+	int	sndbuf;		/* SO_SNDBUF, bytes */
+	int	rcvbuf;		/* SO_RCVBUF, bytes */
+	int	cork;		/* TCP_CORK in inet_cork() */
+	int	keepalive;	/* SO_KEEPALIVE, idle seconds before probes */
+	int	user_timeout;	/* TCP_USER_TIMEOUT, ms */
+	int	fastopen;	/* TCP Fast Open, the listeners' queue length */
+	int	defer_accept;	/* TCP_DEFER_ACCEPT of the listeners, seconds */
+};
+
+/* A host of unix:/path or unix:@name (abstract) is a Unix domain socket,
+ * "tcp" makes it a stream and "udp" a datagram one, port is ignored. */
 int inet_connect(const char *proto, const char *host,
 		 const char *port, int (*nonblock)(int));
 int inet_listen(const char *proto, const char *host, const char *port);
 
+/* Bind every resolved address (IPv4 and IPv6), up to n listeners are put
+ * to fds. The number of listeners or -1 in case of failure. */
+int inet_listen_all(const char *proto, const char *host, const char *port,
+		    int *fds, int n);
+
+/* 0 in case of success and -1 in case of failure. */
+int inet_race_start(struct inet_race *r, const char *proto,
+		    const char *host, const char *port);
+
+/* The connected non-blocking socket or -1, errno is EINPROGRESS while
+ * the race goes on. */
+int inet_race_step(struct inet_race *r);
+
+/* Up to INET_RACE_MAX pending attempts (or the pending lookup) for
+ * poll(), *tmo is the time in ms till the next attempt or -1. */
+int inet_race_fds(struct inet_race *r, struct pollfd *fds, int *tmo);
+
+void inet_race_end(struct inet_race *r);
+
+/* Fills t for "latency" or "throughput" (on top of what it has), 0 in
+ * case of success or -1 for an unknown name. */
+int inet_tune_profile(struct inet_tune *t, const char *name);
+
+/* The tuning inet_connect(), the races and the listeners apply to their
+ * sockets, NULL turns it off. The accepted sockets get it with
+ * inet_tune(fd, NULL). With fastopen a connect completes at once when
+ * the server's cookie is known and the first send() goes in the SYN
+ * (net.ipv4.tcp_fastopen must allow the client and the server side). */
+void inet_set_tune(const struct inet_tune *t);
+
+/* Applies t (or the one set) as far as the socket supports it, TCP
+ * options are skipped for other sockets and fastopen and defer_accept
+ * are left to connect and listen. 0 or -1 if some option was
+ * refused, the rest are still applied. */
+int inet_tune(int fd, const struct inet_tune *t);
+
+/* Holds partial segments back while on, if the tuning has cork. */
+int inet_cork(int fd, int on);
+
+/* Sets how long resolved names are cached, 0 turns the cache off. The
+ * resolver doesn't tell the records' TTL, so it's the upper bound. */
+void inet_dns_ttl(int ms);
+
 #define tcp_connect(h, p, n)	inet_connect("tcp", (h), (p), (n))
 #define udp_connect(h, p, n)	inet_connect("udp", (h), (p), (n))
 #define tcp_listen(h, p)	inet_listen("tcp", (h), (p))
 #define udp_listen(h, p)	inet_listen("udp", (h), (p))
 
 #endif /* INET_H */
-
@@ -0,0 +1,492 @@
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "ws.h"
+#include "pool.h"
+
+#define DEQ_MIN		64
+/* Messages of a serial queue handled before the worker moves on. */
+#define BATCH		16
+
+/* Ready serial queues of a worker. The owner takes the newest one, the
+ * thieves take the oldest ones. */
+struct deq {
+	pthread_mutex_t	lock;
+	ws_serial	**a;
+	size_t		cap;
+	size_t		head;
+	size_t		len;
+};
+
+struct worker {
+	ws_pool		*p;
+	int		i;
+	pthread_t	t;
+	struct deq	d;
+};
+
+struct ws_pool {
+	struct worker	*w;
+	int		n;
+	void		(*work)(void *arg, ws_pmsg *m);
+	void		*arg;
+	/* Idle workers sleep till ready serial queues show up. */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	long		ready;
+	int		idle;
+	int		stop;
+	unsigned int	rr;
+};
+
+struct ws_cq {
+	pthread_mutex_t	lock;
+	ws_pmsg		*head;
+	ws_pmsg		*tail;
+	int		fd[2];
+	int		signaled;
+};
+
+struct ws_serial {
+	pthread_mutex_t	lock;
+	ws_pmsg		*head;
+	ws_pmsg		*tail;
+	/* On a deque or being handled. */
+	int		sched;
+	/* The loop, the scheduling and every message not yet done. */
+	long		refs;
+	ws_pool		*p;
+	ws_cq		*q;
+	void		*opaque;
+	void		(*done)(void *opaque, ws_pmsg *m);
+	unsigned long	id;
+	/* The loop's side. */
+	size_t		pending;
+	int		dead;
+	unsigned char	*mbuf;
+	size_t		mlen;
+	size_t		mcap;
+	int		mtxt;
+};
+
+static unsigned long serial_ids;
+
+static int deq_push(struct deq *d, ws_serial *s, int top)
+{
+	ws_serial **a;
+	size_t i, cap;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->len == d->cap) {
+		cap = d->cap ? 2 * d->cap : DEQ_MIN;
+		if ((a = malloc(cap * sizeof(*a))) == NULL) {
+			pthread_mutex_unlock(&d->lock);
+			return -1;
+		}
+		for (i = 0; i < d->len; i++)
+			a[i] = d->a[(d->head + i) % d->cap];
+		free(d->a);
+		d->a = a;
+		d->cap = cap;
+		d->head = 0;
+	}
+	if (top) {
+		d->head = (d->head + d->cap - 1) % d->cap;
+		d->a[d->head] = s;
+	} else
+		d->a[(d->head + d->len) % d->cap] = s;
+	d->len++;
+	pthread_mutex_unlock(&d->lock);
+
+	return 0;
+}
+
+static ws_serial *deq_pop(struct deq *d, int top)
+{
+	ws_serial *s = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->len > 0 && top) {
+		s = d->a[d->head];
+		d->head = (d->head + 1) % d->cap;
+		d->len--;
+	} else if (d->len > 0)
+		s = d->a[(d->head + --d->len) % d->cap];
+	pthread_mutex_unlock(&d->lock);
+
+	return s;
+}
+
+static void serial_put(ws_serial *s)
+{
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	pthread_mutex_destroy(&s->lock);
+	free(s->mbuf);
+	free(s);
+}
+
+/* w < 0 picks a worker in turn. */
+static void schedule(ws_pool *p, ws_serial *s, int w, int top)
+{
+	if (w < 0)
+		w = __atomic_fetch_add(&p->rr, 1, __ATOMIC_RELAXED) % p->n;
+
+	/* The deques grow, a failure only leaves a worker without it. */
+	while (deq_push(&p->w[w].d, s, top) < 0)
+		w = (w + 1) % p->n;
+
+	/* Set before the idle count is read, a worker going to sleep
+	 * counts itself idle before it checks it. */
+	__atomic_add_fetch(&p->ready, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+static void cq_push(ws_cq *q, ws_pmsg *head, ws_pmsg *tail)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail)
+		q->tail->next = head;
+	else
+		q->head = head;
+	q->tail = tail;
+	if (!q->signaled) {
+		q->signaled = 1;
+		while (write(q->fd[1], "", 1) < 0 && errno == EINTR)
+			;
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void serial_run(struct worker *w, ws_serial *s)
+{
+	ws_pool *p = w->p;
+	ws_pmsg *head, *tail, *m;
+	int i, more;
+
+	pthread_mutex_lock(&s->lock);
+	head = tail = s->head;
+	for (i = 1; i < BATCH && tail->next; i++)
+		tail = tail->next;
+	s->head = tail->next;
+	if (!s->head)
+		s->tail = NULL;
+	tail->next = NULL;
+	pthread_mutex_unlock(&s->lock);
+
+	for (m = head; m; m = m->next)
+		p->work(p->arg, m);
+
+	/* Results go out before another worker may take the queue. */
+	cq_push(s->q, head, tail);
+
+	pthread_mutex_lock(&s->lock);
+	if (!(more = s->head != NULL))
+		s->sched = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	/* Behind the other queues of this worker. */
+	if (more)
+		schedule(p, s, w->i, 1);
+	else
+		serial_put(s);
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	ws_pool *p = w->p;
+	ws_serial *s;
+	int i, stop;
+
+	for (;;) {
+		s = deq_pop(&w->d, 0);
+		for (i = 1; !s && i < p->n; i++)
+			s = deq_pop(&p->w[(w->i + i) % p->n].d, 1);
+		if (s) {
+			__atomic_sub_fetch(&p->ready, 1, __ATOMIC_SEQ_CST);
+			serial_run(w, s);
+			continue;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		__atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&p->ready, __ATOMIC_SEQ_CST) &&
+		       !p->stop)
+			pthread_cond_wait(&p->cond, &p->lock);
+		__atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+		stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+ws_pool *ws_pool_new(int n, void (*work)(void *arg, ws_pmsg *m), void *arg)
+{
+	sigset_t all, old;
+	ws_pool *p;
+	long cpus;
+	int i;
+
+	if (n <= 0)
+		n = (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (int)cpus : 1;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	if ((p->w = calloc(n, sizeof(*p->w))) == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	p->work = work;
+	p->arg = arg;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	/* The workers must not take the process' signals. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < n; i++) {
+		p->w[i].p = p;
+		p->w[i].i = i;
+		pthread_mutex_init(&p->w[i].d.lock, NULL);
+		if (pthread_create(&p->w[i].t, NULL, worker_run, &p->w[i]))
+			break;
+		p->n++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (p->n < n) {
+		pthread_mutex_destroy(&p->w[i].d.lock);
+		ws_pool_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void ws_pool_free(ws_pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->n; i++) {
+		pthread_join(p->w[i].t, NULL);
+		pthread_mutex_destroy(&p->w[i].d.lock);
+		free(p->w[i].d.a);
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->w);
+	free(p);
+}
+
+ws_cq *ws_cq_new(void)
+{
+	ws_cq *q;
+	int i, flags;
+
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		return NULL;
+	if (pipe(q->fd) < 0) {
+		free(q);
+		return NULL;
+	}
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl(q->fd[i], F_GETFL)) < 0 ||
+		    fcntl(q->fd[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+		    fcntl(q->fd[i], F_SETFD, FD_CLOEXEC) < 0) {
+			ws_cq_free(q);
+			return NULL;
+		}
+	pthread_mutex_init(&q->lock, NULL);
+
+	return q;
+}
+
+void ws_cq_free(ws_cq *q)
+{
+	ws_pmsg *m;
+
+	while ((m = q->head) != NULL) {
+		q->head = m->next;
+		free(m->buf);
+		serial_put(m->s);
+		free(m);
+	}
+	close(q->fd[0]);
+	close(q->fd[1]);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+int ws_cq_fd(ws_cq *q)
+{
+	return q->fd[0];
+}
+
+int ws_cq_run(ws_cq *q)
+{
+	unsigned char buf[64];
+	ws_pmsg *m, *next;
+	ws_serial *s;
+	int cnt = 0;
+
+	pthread_mutex_lock(&q->lock);
+	m = q->head;
+	q->head = q->tail = NULL;
+	if (q->signaled) {
+		while (read(q->fd[0], buf, sizeof(buf)) > 0)
+			;
+		q->signaled = 0;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	for (; m; m = next, cnt++) {
+		next = m->next;
+		s = m->s;
+		s->pending--;
+		if (!s->dead && s->done)
+			s->done(s->opaque, m);
+		free(m->buf);
+		free(m);
+		serial_put(s);
+	}
+
+	return cnt;
+}
+
+ws_serial *ws_serial_new(ws_pool *p, ws_cq *q, void *opaque,
+			 void (*done)(void *opaque, ws_pmsg *m))
+{
+	ws_serial *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+
+	pthread_mutex_init(&s->lock, NULL);
+	s->refs = 1;
+	s->p = p;
+	s->q = q;
+	s->opaque = opaque;
+	s->done = done;
+	s->id = __atomic_add_fetch(&serial_ids, 1, __ATOMIC_RELAXED);
+
+	return s;
+}
+
+void ws_serial_free(ws_serial *s)
+{
+	s->dead = 1;
+	serial_put(s);
+}
+
+unsigned long ws_serial_id(ws_serial *s)
+{
+	return s->id;
+}
+
+size_t ws_serial_pending(ws_serial *s)
+{
+	return s->pending;
+}
+
+int ws_serial_submit(ws_serial *s, void *buf, size_t n, int txt)
+{
+	ws_pmsg *m;
+	int sched;
+
+	if ((m = malloc(sizeof(*m))) == NULL) {
+		free(buf);
+		return WS_E_QUEUE_LIMIT;
+	}
+	m->buf = buf;
+	m->n = n;
+	m->txt = txt;
+	m->next = NULL;
+	m->s = s;
+
+	s->pending++;
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->tail)
+		s->tail->next = m;
+	else
+		s->head = m;
+	s->tail = m;
+	if ((sched = !s->sched))
+		s->sched = 1;
+	pthread_mutex_unlock(&s->lock);
+
+	if (sched) {
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+		schedule(s->p, s, -1, 0);
+	}
+
+	return 0;
+}
+
+int ws_serial_parse(ws_serial *s, WebSocket *ws, ws_frame *f)
+{
+	unsigned char *p;
+	size_t cap;
+	int rc;
+
+	for (;;) {
+		if ((rc = ws_read_frame(ws, f)))
+			return rc;
+		if (f->op & 0x08)
+			return 0;
+
+		if (f->off == 0) {
+			if (f->op != WS_OP_CONT)
+				s->mtxt = f->op == WS_OP_TEXT;
+			if (ws->limit && s->mlen + f->len > ws->limit)
+				return WS_E_TOO_LONG;
+		}
+		/* The buffer grows with what has arrived, not with the
+		 * length the peer claims. */
+		if (s->mlen + f->n > s->mcap) {
+			cap = s->mcap ? s->mcap : 4096;
+			while (cap < s->mlen + f->n)
+				cap *= 2;
+			if ((p = realloc(s->mbuf, cap)) == NULL)
+				return WS_E_QUEUE_LIMIT;
+			s->mbuf = p;
+			s->mcap = cap;
+		}
+		if (f->n > 0)
+			memcpy(s->mbuf + s->mlen, f->buf, f->n);
+		s->mlen += f->n;
+
+		if (!f->fin || f->off + f->n < f->len)
+			continue;
+
+		rc = ws_serial_submit(s, s->mbuf, s->mlen, s->mtxt);
+		s->mbuf = NULL;
+		s->mlen = s->mcap = 0;
+		if (rc)
+			return rc;
+	}
+}
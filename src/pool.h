@@ -0,0 +1,67 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Message handlers on a work-stealing thread pool. Every connection has
+ * a serial queue: its messages are handled one at a time and in order by
+ * whichever worker is free, and the results come back in the same order
+ * on the loop owning the connection, through its completion queue. The
+ * serial and completion queue calls belong to that loop's thread. */
+
+typedef struct ws_pool ws_pool;
+typedef struct ws_serial ws_serial;
+typedef struct ws_cq ws_cq;
+typedef struct ws_pmsg ws_pmsg;
+
+struct ws_pmsg {
+	void		*buf;	/* malloc()ed */
+	size_t		n;
+	int		txt;
+	ws_pmsg		*next;
+	ws_serial	*s;
+};
+
+/* n workers (0 means one per CPU) call work(arg, m) for every message.
+ * work may replace m->buf (freeing the old one) and m->n with a result.
+ * NULL in case of failure. */
+ws_pool *ws_pool_new(int n, void (*work)(void *arg, ws_pmsg *m), void *arg);
+
+/* Stops and joins the workers, free the serial queues first. */
+void ws_pool_free(ws_pool *p);
+
+/* NULL in case of failure. */
+ws_cq *ws_cq_new(void);
+void ws_cq_free(ws_cq *q);
+
+/* Readable while results are waiting for ws_cq_run(). */
+int ws_cq_fd(ws_cq *q);
+
+/* Calls done(opaque, m) of the serial queues for the results, m->buf is
+ * freed afterwards unless done sets it to NULL. The number of results. */
+int ws_cq_run(ws_cq *q);
+
+/* done may be NULL. NULL in case of failure. */
+ws_serial *ws_serial_new(ws_pool *p, ws_cq *q, void *opaque,
+			 void (*done)(void *opaque, ws_pmsg *m));
+
+/* The queue goes away once its workers are done, done isn't called for
+ * the results left. */
+void ws_serial_free(ws_serial *s);
+
+/* Unique and never 0, the handlers may send to the connection with
+ * ws_inbox_send() under it (any thread may call it). */
+unsigned long ws_serial_id(ws_serial *s);
+
+/* Messages submitted but not yet done, the loop may stop reading the
+ * connection while there are too many. */
+size_t ws_serial_pending(ws_serial *s);
+
+/* Takes buf (malloc()ed). 0 in case of success or WS_E_QUEUE_LIMIT. */
+int ws_serial_submit(ws_serial *s, void *buf, size_t n, int txt);
+
+/* Reads ws with ws_read_frame() and submits the complete data messages,
+ * like the frame interface it doesn't validate the payload. 0 with
+ * a control frame in f for the caller, WS_E_WANT_READ when ws is drained
+ * or < 0. A message longer than ws_set_data_limit() is WS_E_TOO_LONG. */
+int ws_serial_parse(ws_serial *s, WebSocket *ws, ws_frame *f);
+
+#endif /* POOL_H */
@@ -0,0 +1,127 @@
+#ifdef __linux__
+#  define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "ring.h"
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+static unsigned char *mirror_map(size_t size)
+{
+	unsigned char *p;
+	int fd;
+
+	if ((fd = memfd_create("ring", MFD_CLOEXEC)) < 0)
+		return NULL;
+	if (ftruncate(fd, size) < 0)
+		goto err;
+
+	/* Reserve the address space and map the same pages twice. */
+	p = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		goto err;
+	if (mmap(p, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(p + size, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, 2 * size);
+		goto err;
+	}
+
+	close(fd);
+	return p;
+err:
+	close(fd);
+	return NULL;
+}
+#else
+static unsigned char *mirror_map(size_t size)
+{
+	(void)size;
+	return NULL;
+}
+#endif
+
+int ring_init(struct ring *r, size_t size)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+
+	memset(r, 0, sizeof(*r));
+	r->size = (size + pg - 1) / pg * pg;
+
+	if ((r->buf = mirror_map(r->size)) != NULL) {
+		r->mirror = 1;
+		return 0;
+	}
+
+	if ((r->buf = malloc(r->size)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+void ring_deinit(struct ring *r)
+{
+	if (r->mirror)
+		munmap(r->buf, 2 * r->size);
+	else
+		free(r->buf);
+	memset(r, 0, sizeof(*r));
+}
+
+int ring_resize(struct ring *r, size_t size)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	struct ring n;
+
+	if ((size + pg - 1) / pg * pg == r->size)
+		return 0;
+	if (ring_init(&n, size) < 0)
+		return -1;
+	if (n.size < r->len) {
+		ring_deinit(&n);
+		return -1;
+	}
+
+	/* The buffered bytes are contiguous in both layouts. */
+	memcpy(n.buf, RING_RPTR(r), r->len);
+	n.len = r->len;
+	ring_deinit(r);
+	*r = n;
+
+	return 0;
+}
+
+size_t ring_room(struct ring *r, unsigned char **ptr)
+{
+	if (!r->mirror && r->head > 0 && r->head + r->len == r->size) {
+		/* Linear fallback, move the data to the front. */
+		memmove(r->buf, r->buf + r->head, r->len);
+		r->head = 0;
+	}
+
+	*ptr = r->buf + r->head + r->len;
+	return r->mirror ? r->size - r->len : r->size - r->head - r->len;
+}
+
+void ring_produce(struct ring *r, size_t n)
+{
+	assert(r->len + n <= r->size);
+	r->len += n;
+}
+
+void ring_consume(struct ring *r, size_t n)
+{
+	assert(n <= r->len);
+	r->len  -= n;
+	r->head += n;
+	if (r->len == 0 || r->head >= r->size)
+		r->head = r->len == 0 ? 0 : r->head - r->size;
+}
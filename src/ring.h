@@ -0,0 +1,38 @@
+#ifndef RING_H
+#define RING_H
+
+/* A byte ring. When possible the memory is mapped twice back to back, so
+ * any span up to the ring size starting at the read or the write position
+ * is contiguous and there is no wraparound and no memmove. Otherwise
+ * the ring falls back to a linear buffer which is compacted on demand. */
+struct ring {
+	unsigned char	*buf;
+	size_t		size;
+	size_t		head;
+	size_t		len;
+	int		mirror;
+};
+
+#define RING_RPTR(r)	((r)->buf + (r)->head)
+#define RING_LEN(r)	((r)->len)
+
+/* size is rounded up to the page size. 0 in case of success and -1
+ * in case of failure. */
+int ring_init(struct ring *r, size_t size);
+void ring_deinit(struct ring *r);
+
+/* Move the buffered bytes into a ring of the new size (rounded up to the
+ * page size). 0 in case of success, -1 if they don't fit or in case of
+ * failure, the ring is intact then. */
+int ring_resize(struct ring *r, size_t size);
+
+/* Contiguous room at the write position, *ptr points to it. */
+size_t ring_room(struct ring *r, unsigned char **ptr);
+
+/* n bytes are written at the write position. */
+void ring_produce(struct ring *r, size_t n);
+
+/* n bytes are read from the read position. */
+void ring_consume(struct ring *r, size_t n);
+
+#endif /* RING_H */
@@ -0,0 +1,180 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "ws.h"
+#include "tls.h"
+
+#define SOFT_ERROR	(errno == EINTR || errno == EAGAIN || \
+			 errno == EWOULDBLOCK)
+
+SSL_CTX *tls_bio_ctx(int srv, const char *cert, const char *key,
+			const char *ca, int ktls)
+{
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(srv ? TLS_server_method() : TLS_client_method());
+	if (!ctx)
+		return NULL;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/* The frame writer repeats writes with the same data anyway. */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* A peer may close the socket right after the close frame. */
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if (ktls)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+	(void)ktls;
+#endif
+
+	if (srv) {
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(ctx, key,
+						SSL_FILETYPE_PEM) != 1)
+			goto err;
+	} else {
+		if ((ca ? SSL_CTX_load_verify_locations(ctx, ca, NULL) :
+			  SSL_CTX_set_default_verify_paths(ctx)) != 1)
+			goto err;
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	return ctx;
+err:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+int tls_bio_init(struct tls_bio *t, SSL_CTX *ctx, int fd, const char *host)
+{
+	memset(t, 0, sizeof(*t));
+
+	if ((t->ssl = SSL_new(ctx)) == NULL)
+		return -1;
+
+	if (SSL_set_fd(t->ssl, fd) != 1)
+		goto err;
+
+	if (host) {
+		/* SNI and the name check of the server's certificate. */
+		if (SSL_set_tlsext_host_name(t->ssl, host) != 1 ||
+		    SSL_set1_host(t->ssl, host) != 1)
+			goto err;
+		SSL_set_connect_state(t->ssl);
+	} else {
+		SSL_set_accept_state(t->ssl);
+	}
+
+	t->fd = fd;
+	return 0;
+err:
+	SSL_free(t->ssl);
+	t->ssl = NULL;
+	return -1;
+}
+
+void tls_bio_deinit(struct tls_bio *t)
+{
+	if (t->ssl) {
+		SSL_shutdown(t->ssl);
+		SSL_free(t->ssl);
+	}
+	memset(t, 0, sizeof(*t));
+}
+
+static int tls_err(struct tls_bio *t, int rc, int want)
+{
+	switch (SSL_get_error(t->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return want;
+	case SSL_ERROR_ZERO_RETURN:
+		return WS_E_EOF;
+	case SSL_ERROR_SYSCALL:
+		if (SOFT_ERROR)
+			return want;
+		/* THROUGH */
+	default:
+		ERR_clear_error();
+		return WS_E_IO;
+	}
+}
+
+int tls_bio_handshake(struct tls_bio *t)
+{
+	int rc;
+
+	if ((rc = SSL_do_handshake(t->ssl)) != 1) {
+		switch (SSL_get_error(t->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			return WS_E_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return WS_E_WANT_WRITE;
+		default:
+			ERR_clear_error();
+			return WS_E_IO;
+		}
+	}
+
+	/* The keys are in the kernel (if it took them). */
+	t->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(t->ssl)) > 0;
+	t->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(t->ssl)) > 0;
+
+	return 0;
+}
+
+ssize_t tls_bio_send(void *ctx, const void *buf, size_t n)
+{
+	struct tls_bio *t = ctx;
+	ssize_t rc;
+
+	/* The kernel builds records, no copy through OpenSSL. */
+	if (t->ktls_tx) {
+		rc = send(t->fd, buf, n, 0);
+		if (rc < 0)
+			return SOFT_ERROR ? WS_E_WANT_WRITE : WS_E_IO;
+		return rc;
+	}
+
+	if ((rc = SSL_write(t->ssl, buf, n)) <= 0)
+		return tls_err(t, rc, WS_E_WANT_WRITE);
+
+	return rc;
+}
+
+ssize_t tls_bio_recv(void *ctx, void *buf, size_t n)
+{
+	struct tls_bio *t = ctx;
+	ssize_t rc;
+
+	if ((rc = SSL_read(t->ssl, buf, n)) <= 0)
+		return tls_err(t, rc, WS_E_WANT_READ);
+
+	return rc;
+}
+
+ssize_t tls_bio_sendfile(void *ctx, int fd, off_t *off, size_t n)
+{
+	struct tls_bio *t = ctx;
+	ossl_ssize_t rc;
+
+	if (!t->ktls_tx)
+		return WS_E_IO;
+
+	rc = SSL_sendfile(t->ssl, fd, *off, n, 0);
+	if (rc <= 0)
+		return tls_err(t, rc, WS_E_WANT_WRITE);
+
+	*off += rc;
+	return rc;
+}
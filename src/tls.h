@@ -0,0 +1,39 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+/* TLS behind the WebSocket bio. With kTLS the kernel encrypts (and maybe
+ * decrypts) the records, so plain send(), sendfile() and splice() work
+ * on the socket after the handshake. */
+struct tls_bio {
+	/* The socket goes first, so the bio context may be used as a plain
+	 * socket's int * context. */
+	int		fd;
+	SSL		*ssl;
+	int		ktls_tx;
+	int		ktls_rx;
+};
+
+/* A server needs cert and key, a client verifies the server against ca
+ * (or the default paths if ca is NULL). ktls asks OpenSSL to pass the
+ * session keys to the kernel. NULL in case of failure. */
+SSL_CTX *tls_bio_ctx(int srv, const char *cert, const char *key,
+			const char *ca, int ktls);
+
+/* 0 in case of success and -1 in case of failure. host is the name
+ * which a client checks in the server's certificate. */
+int tls_bio_init(struct tls_bio *t, SSL_CTX *ctx, int fd, const char *host);
+void tls_bio_deinit(struct tls_bio *t);
+
+/* 0 in case of success or < 0 (WS_E_WANT_READ, WS_E_WANT_WRITE and
+ * WS_E_IO). */
+int tls_bio_handshake(struct tls_bio *t);
+
+/* The bio for ws_set_bio(), ws_set_bio_sendfile() and ws_set_bio_splice(),
+ * ctx is struct tls_bio. sendfile and splice need kTLS. */
+ssize_t tls_bio_send(void *ctx, const void *buf, size_t n);
+ssize_t tls_bio_recv(void *ctx, void *buf, size_t n);
+ssize_t tls_bio_sendfile(void *ctx, int fd, off_t *off, size_t n);
+
+#endif /* TLS_H */
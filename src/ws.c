@@ -1,25 +1,38 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 #include <limits.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "ws.h"
 #include "sha1.h"
 #include "base64.h"
 
-#define OP_CONT			0x00
-#define OP_TEXT			0x01
-#define OP_BIN			0x02
+#define OP_CONT			WS_OP_CONT
+#define OP_TEXT			WS_OP_TEXT
+#define OP_BIN			WS_OP_BIN
 /* 0x03 - 0x07 reserved */
-#define OP_CLOSE		0x08
-#define OP_PING			0x09
-#define OP_PONG			0x0A
+#define OP_CLOSE		WS_OP_CLOSE
+#define OP_PING			WS_OP_PING
+#define OP_PONG			WS_OP_PONG
 /* 0x0B - 0x0F reserved */
 
+/* The codec is compiled once per role, srv is a constant in its body. */
+#if defined(__GNUC__) || defined(__clang__)
+#  define CODEC		static inline __attribute__((always_inline))
+#else
+#  define CODEC		static inline
+#endif
+
 #define CTRL(op)		(((op) >> 3) & 0x01)
 #define DATA(op)		((op) != OP_CONT && !CTRL((op)))
 #define CONT(op)		((op) == OP_CONT)
@@ -33,16 +46,26 @@
 #define HDR_REQ_ALL		(HDR_HOST | HDR_UPGRADE | HDR_SEC_KEY)
 #define HDR_RES_ALL		(HDR_UPGRADE | HDR_SEC_ACCEPT)
 
+#define SOFT_ERROR		(errno == EINTR || errno == EAGAIN || \
+				 errno == EWOULDBLOCK)
+
 #define STREQI(s1, s2)		(strcasecmp(s1, s2) == 0)
 #define STREQ(s1, s2)		(strcmp(s1, s2) == 0)
 
-#define WS_I_BUF(ws)		((ws)->i_buf + (ws)->i_off)
-#define WS_I_BUF_LEN(ws)	(WS_BUF_SIZE - (ws)->i_off)
 #define WS_O_BUF(ws)		((ws)->o_buf + (ws)->o_off)
-#define WS_O_BUF_LEN(ws)	(WS_BUF_SIZE - (ws)->o_off)
+#define WS_O_BUF_LEN(ws)	((ws)->o_size - (ws)->o_off)
+
+/* A buffer doubles after BUF_GROW_RUNS uses in a row fill it and halves
+ * after BUF_SHRINK_RUNS uses in a row take less than a quarter of it. */
+#define BUF_GROW_RUNS		2
+#define BUF_SHRINK_RUNS		64
 
 #define ARRSZ(a)		(sizeof((a)) / sizeof((a)[0]))
 
+/* The state after the frame length and the mask are known. */
+#define I_NEXT(ws)		((ws)->i_len > 0 ? STATE_I_PAYLOAD0 : \
+				 CTRL((ws)->op) ? STATE_I_CTRL : STATE_I_HDR)
+
 #define HTTP_SW			0
 #define HTTP_BAD		1
 #define HTTP_NFOUND		2
@@ -55,7 +78,8 @@ enum {
 	STATE_H_MSG_RD,
 	STATE_H_MSG_WR,
 	STATE_H_REQ,
-	STATE_H_RES
+	STATE_H_RES,
+	STATE_H_REJECT
 };
 
 enum {
@@ -66,13 +90,17 @@ enum {
 	STATE_I_PAYLOAD0,
 	STATE_I_PAYLOAD,
 	STATE_I_CTRL,
-	STATE_I_DRAIN
+	STATE_I_DRAIN,
+	STATE_I_SINK,
+	STATE_I_FRAME
 };
 
 enum {
 	STATE_O_HDR,
+	STATE_O_FRAG,
 	STATE_O_PAYLOAD,
-	STATE_O_DRAIN
+	STATE_O_DRAIN,
+	STATE_O_FILE
 };
 
 struct http_hdr {
@@ -99,6 +127,26 @@ struct ws_hand {
 	char		*sec;
 };
 
+static void q_pop(WebSocket *ws);
+static ssize_t srv_handler(WebSocket *ws, union ws_arg *arg, int hnd);
+static ssize_t usr_handler(WebSocket *ws, union ws_arg *arg, int hnd);
+static ssize_t srv_send(WebSocket *ws, unsigned char op, const void *buf,
+			int fd, off_t off, size_t n);
+static ssize_t usr_send(WebSocket *ws, unsigned char op, const void *buf,
+			int fd, off_t off, size_t n);
+
+/* Fast rejects are static, nothing is formatted or allocated. */
+static const char http_reject_bad[] =
+	"HTTP/1.1 400 Bad Request" CRLF
+	"Connection: close" CRLF
+	"Content-Length: 0" CRLF CRLF;
+
+static const char http_reject_busy[] =
+	"HTTP/1.1 503 Service Unavailable" CRLF
+	"Connection: close" CRLF
+	"Retry-After: 1" CRLF
+	"Content-Length: 0" CRLF CRLF;
+
 static const char *http_status_msg[] = {
 	"101 Switching Protocols",
 	"400 Bad Request",
@@ -228,7 +276,7 @@ http_msg_res(WebSocket *ws, int status, int ver,
 	if (status > (int)ARRSZ(http_status_msg))
 		return -1;
 
-	rc = snprintf((char *)ws->o_buf, WS_BUF_SIZE,
+	rc = snprintf((char *)ws->o_buf, ws->o_size,
 			"HTTP/1.%d %s" CRLF,
 			ver, http_status_msg[status]);
 	if (rc < 0 || rc >= (int)WS_O_BUF_LEN(ws))
@@ -247,7 +295,7 @@ http_msg_req(WebSocket *ws, const char *method, const char *path, int ver,
 
 	assert(ws->o_off == 0);
 
-	rc = snprintf((char *)ws->o_buf, WS_BUF_SIZE,
+	rc = snprintf((char *)ws->o_buf, ws->o_size,
 			"%s %s HTTP/1.%d" CRLF, method, path, ver);
 	if (rc < 0 || rc >= (int)WS_O_BUF_LEN(ws))
 		return -1;
@@ -259,28 +307,42 @@ http_msg_req(WebSocket *ws, const char *method, const char *path, int ver,
 
 static int http_msg_collect(WebSocket *ws)
 {
+	unsigned char *w;
+	size_t room;
 	ssize_t n;
 	char *p;
 
 	for (;;) {
-		n = ws->recv(ws->ctx, WS_I_BUF(ws), WS_I_BUF_LEN(ws)-1);
+		room = ring_room(&ws->i_ring, &w);
+		/* The buffer is full and there is no CRLFx2. */
+		if (room <= 1)
+			return WS_E_HANDSHAKE;
+		/* The header is over its budget. */
+		if (ws->h_max) {
+			if (RING_LEN(&ws->i_ring) >= ws->h_max)
+				return WS_E_HTTP_HDR_LIMIT;
+			if (room - 1 > ws->h_max - RING_LEN(&ws->i_ring))
+				room = ws->h_max - RING_LEN(&ws->i_ring) + 1;
+		}
+
+		n = ws->recv(ws->ctx, w, room - 1);
 		if (n <= 0)
 			return !n ? WS_E_EOF : n;
 
-		ws->i_off += n;
-		ws->i_buf[ws->i_off] = 0;
+		ring_produce(&ws->i_ring, n);
+		w[n] = 0;
 		/* Find the end of http header. */
-		p = strstr((char *)ws->i_buf, CRLFx2);
+		p = strstr((char *)RING_RPTR(&ws->i_ring), CRLFx2);
 		if (p) {
 			*(p + 2) = 0;
 			break;
 		}
-		/* The buffer is full and there is no CRLFx2. */
-		if (WS_I_BUF_LEN(ws)-1 == 0)
-			return WS_E_HANDSHAKE;
 	}
 
-	ws->i_off = 0;
+	/* The header stays in place until the next read, anything after
+	 * it is the beginning of the frames. */
+	ws->i_data = RING_RPTR(&ws->i_ring);
+	ring_consume(&ws->i_ring, (unsigned char *)p + 4 - ws->i_data);
 
 	return 0;
 }
@@ -402,7 +464,7 @@ http_req(WebSocket *ws, void *opaque,
 	char *p, *uri, *method;
 	int rc, ver;
 
-	p = (char *)ws->i_buf;
+	p = (char *)ws->i_data;
 
 	rc = http_req_line(&p, &method, &uri, &ver);
 	if (rc < 0)
@@ -500,7 +562,7 @@ http_res(WebSocket *ws, void *opaque,
 	int rc, ver, code;
 	char *p, *reason;
 
-	p = (char *)ws->i_buf;
+	p = (char *)ws->i_data;
 
 	rc = http_res_line(&p, &ver, &code, &reason);
 	if (rc < 0)
@@ -632,12 +694,67 @@ static int usr_handshake(WebSocket *ws, const char *host,
 	return rc;
 }
 
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int ws_handshake(WebSocket *ws, const char *host,
 				const char *uri, const char *uhdrs)
 {
+	/* The deadline starts with the first call. */
+	if (ws->h_tmo) {
+		if (!ws->h_deadline)
+			ws->h_deadline = now_ms() + ws->h_tmo;
+		else if (now_ms() >= ws->h_deadline)
+			return WS_E_TIMEOUT;
+	}
+
 	return (ws->srv ? srv_handshake : usr_handshake)(ws, host, uri, uhdrs);
 }
 
+int ws_handshake_timeout(WebSocket *ws)
+{
+	long long left;
+
+	if (!ws->h_deadline)
+		return ws->h_tmo ? (int)ws->h_tmo : -1;
+
+	left = ws->h_deadline - now_ms();
+	return left > 0 ? (int)left : 0;
+}
+
+void ws_set_handshake_limit(WebSocket *ws, size_t hdr_max, unsigned int tmo)
+{
+	ws->h_max = hdr_max;
+	ws->h_tmo = tmo;
+}
+
+int ws_reject(WebSocket *ws, int busy)
+{
+	const char *msg = busy ? http_reject_busy : http_reject_bad;
+	ssize_t n;
+
+	if (ws->h_state != STATE_H_REJECT) {
+		ws->h_state = STATE_H_REJECT;
+		ws->o_data = (unsigned char *)msg;
+		ws->o_left = strlen(msg);
+	}
+
+	while (ws->o_left > 0) {
+		n = ws->send(ws->ctx, ws->o_data, ws->o_left);
+		if (n < 0)
+			return n;
+		ws->o_data += n;
+		ws->o_left -= n;
+	}
+
+	return 0;
+}
+
 static uint16_t get_u16(uint8_t *p)
 {
 	return (p[0] << 8) | p[1];
@@ -668,31 +785,159 @@ static void put_u64(uint8_t *p, uint64_t n)
 	p[7] =  n        & 0xFF;
 }
 
+/* dst = src ^ mask, where the mask starts at *imsk. dst may be src. */
+static void mask_copy(unsigned char *dst, const unsigned char *src,
+			size_t n, const unsigned char msk[4], size_t *imsk)
+{
+	unsigned char r[8];
+	uint64_t m, v;
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = msk[(*imsk + i) % 4];
+	memcpy(&m, r, 8);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&v, src + i, 8);
+		v ^= m;
+		memcpy(dst + i, &v, 8);
+	}
+	for (; i < n; i++)
+		dst[i] = src[i] ^ r[i % 8];
+
+	*imsk += n;
+}
+
 static int check_op(unsigned char op)
 {
 	/* drop control bit. */
 	return (op & 0x07) < 3;
 }
 
-static ssize_t recvn(WebSocket *ws, size_t n)
+static int b_charge(WebSocket *ws, size_t n);
+static void b_uncharge(WebSocket *ws, size_t n);
+
+static int b_exhausted(WebSocket *ws)
 {
-	ssize_t rc = WS_E_IO;
+	return ws->b && ws->b->limit &&
+	       __atomic_load_n(&ws->b->used, __ATOMIC_RELAXED) > ws->b->limit;
+}
 
-	assert(ws->i_off < n);
+/* The size a buffer should have after another use of it. */
+static size_t buf_adapt(WebSocket *ws, size_t size, int full, int small,
+			unsigned int *nfull, unsigned int *nsmall)
+{
+	int exhausted = b_exhausted(ws);
 
-	while (ws->i_off < n) {
-		rc = ws->recv(ws->ctx, ws->i_buf + ws->i_off,
-						  n - ws->i_off);
-		if (rc <= 0)
-			return rc == 0 ? WS_E_EOF : rc;
-		ws->i_off += rc;
+	*nfull  = full  ? *nfull  + 1 : 0;
+	*nsmall = small ? *nsmall + 1 : 0;
+
+	if (size > ws->buf_max)
+		return ws->buf_max;
+	if (size < ws->buf_min)
+		return ws->buf_min;
+
+	if (*nfull >= BUF_GROW_RUNS && size < ws->buf_max && !exhausted) {
+		*nfull = 0;
+		return size * 2 < ws->buf_max ? size * 2 : ws->buf_max;
+	}
+	/* Give memory back sooner when the budget is exhausted. */
+	if (*nsmall >= (exhausted ? BUF_GROW_RUNS : BUF_SHRINK_RUNS) &&
+						size > ws->buf_min) {
+		*nsmall = 0;
+		return size / 2 > ws->buf_min ? size / 2 : ws->buf_min;
 	}
 
-	ws->i_off = 0;
+	return size;
+}
+
+static void i_resize(WebSocket *ws, size_t n)
+{
+	struct ring *r = &ws->i_ring;
+	size_t size = r->size;
+
+	if (n == size || ring_resize(r, n) < 0)
+		return;
+
+	if (r->size < size)
+		b_uncharge(ws, size - r->size);
+	else if (b_charge(ws, r->size - size) < 0)
+		ring_resize(r, size);
+}
+
+static void o_resize(WebSocket *ws, size_t n)
+{
+	size_t size = ws->o_size;
+	unsigned char *p;
+
+	/* The header stays. */
+	if (n == size || n <= ws->o_off)
+		return;
+	if (n > size && b_charge(ws, n - size) < 0)
+		return;
+
+	if ((p = realloc(ws->o_buf, n)) == NULL) {
+		if (n > size)
+			b_uncharge(ws, n - size);
+		return;
+	}
+	if (n < size)
+		b_uncharge(ws, size - n);
+
+	ws->o_buf = p;
+	ws->o_size = n;
+}
+
+/* Called right after a read, nothing points into the ring. */
+static void i_adapt(WebSocket *ws)
+{
+	struct ring *r = &ws->i_ring;
+
+	i_resize(ws, buf_adapt(ws, r->size, RING_LEN(r) == r->size,
+			       RING_LEN(r) < r->size / 4,
+			       &ws->i_full, &ws->i_small));
+}
+
+/* Called before a chunk is copied, only the header is in o_buf. */
+static void o_adapt(WebSocket *ws)
+{
+	o_resize(ws, buf_adapt(ws, ws->o_size, ws->o_flen > WS_O_BUF_LEN(ws),
+			       ws->o_off + ws->o_flen < ws->o_size / 4,
+			       &ws->o_full, &ws->o_small));
+}
+
+/* Read as much as the ring takes, the parser works on what is buffered. */
+static ssize_t fill(WebSocket *ws)
+{
+	unsigned char *w;
+	size_t room;
+	ssize_t rc;
+
+	room = ring_room(&ws->i_ring, &w);
+	assert(room > 0);
+
+	rc = ws->recv(ws->ctx, w, room);
+	if (rc <= 0)
+		return rc == 0 ? WS_E_EOF : rc;
+
+	ring_produce(&ws->i_ring, rc);
+	i_adapt(ws);
 
 	return rc;
 }
 
+/* Make n bytes available at the ring's read position. */
+static ssize_t need(WebSocket *ws, size_t n)
+{
+	ssize_t rc;
+
+	while (RING_LEN(&ws->i_ring) < n)
+		if ((rc = fill(ws)) <= 0)
+			return rc;
+
+	return n;
+}
+
 int ws_init(WebSocket *ws, int srv)
 {
 	unsigned char blah[32], buf[64];
@@ -709,18 +954,32 @@ int ws_init(WebSocket *ws, int srv)
 		++olen;
 	}
 
-	p = calloc(1, 2 * WS_BUF_SIZE + olen);
+	memset(ws, 0, sizeof(*ws));
+
+	p = calloc(1, WS_CTRL_SIZE + olen);
 	if (!p)
 		return -1;
 
-	memset(ws, 0, sizeof(*ws));
+	if ((ws->o_buf = malloc(WS_BUF_SIZE)) == NULL) {
+		free(p);
+		return -1;
+	}
+
+	if (ring_init(&ws->i_ring, WS_BUF_SIZE) < 0) {
+		free(ws->o_buf);
+		free(p);
+		return -1;
+	}
+
+	ws->buf_min = ws->buf_max = ws->o_size = WS_BUF_SIZE;
 	ws->srv = srv;
-	ws->i_buf = p;
-	ws->o_buf = p + WS_BUF_SIZE;
+	ws->i_codec = srv ? srv_handler : usr_handler;
+	ws->o_codec = srv ? srv_send : usr_send;
+	ws->o_cbuf = p;
 	ws->utf8_on = 1;
 
 	if (!srv) {
-		ws->sec = (char *)p + WS_BUF_SIZE * 2;
+		ws->sec = (char *)p + WS_CTRL_SIZE;
 		strcpy(ws->sec, (char *)buf);
 	}
 
@@ -729,10 +988,96 @@ int ws_init(WebSocket *ws, int srv)
 
 void ws_deinit(WebSocket *ws)
 {
-	free(ws->i_buf);
+	ws->q_wm = NULL;
+	while (ws->q_head)
+		q_pop(ws);
+	ws_set_budget(ws, NULL);
+	if (ws->o_map)
+		munmap(ws->o_map, ws->o_maplen);
+	free(ws->o_buf);
+	free(ws->o_cbuf);
+	ring_deinit(&ws->i_ring);
 	memset(ws, 0, sizeof(*ws));
 }
 
+void ws_budget_init(ws_budget *b, size_t limit, unsigned int max_conns)
+{
+	memset(b, 0, sizeof(*b));
+	b->limit = limit;
+	b->max_conns = max_conns;
+}
+
+int ws_budget_admit(ws_budget *b)
+{
+	/* A new connection needs at least its buffers. */
+	if (b->max_conns &&
+	    __atomic_load_n(&b->conns, __ATOMIC_RELAXED) >= b->max_conns)
+		return WS_E_BUDGET;
+	if (b->limit && __atomic_load_n(&b->used, __ATOMIC_RELAXED) +
+			2 * WS_BUF_SIZE + WS_CTRL_SIZE > b->limit)
+		return WS_E_BUDGET;
+
+	return 0;
+}
+
+void ws_set_budget(WebSocket *ws, ws_budget *b)
+{
+	ws_qmsg *m;
+
+	if (ws->b) {
+		__atomic_sub_fetch(&ws->b->used, ws->b_used, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&ws->b->conns, 1, __ATOMIC_RELAXED);
+	}
+
+	ws->b = b;
+	ws->b_used = 0;
+	if (!b)
+		return;
+
+	/* What is already allocated is charged even over the limit. */
+	ws->b_used = ws->i_ring.size + ws->o_size + WS_CTRL_SIZE;
+	for (m = ws->q_head; m; m = m->next)
+		ws->b_used += sizeof(*m) + m->n;
+	__atomic_add_fetch(&b->used, ws->b_used, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&b->conns, 1, __ATOMIC_RELAXED);
+}
+
+int ws_budget_shed(WebSocket *ws)
+{
+	ws_budget *b = ws->b;
+	size_t used;
+	unsigned int conns;
+
+	if (!b || !b->limit)
+		return 0;
+
+	used = __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+	conns = __atomic_load_n(&b->conns, __ATOMIC_RELAXED);
+
+	return used > b->limit && conns && ws->b_used > used / conns;
+}
+
+int ws_set_buf_size(WebSocket *ws, size_t min, size_t max)
+{
+	if (min < WS_BUF_MIN)
+		min = WS_BUF_MIN;
+	if (min > max)
+		return -1;
+
+	ws->buf_min = min;
+	ws->buf_max = max;
+
+	/* Start with min if the buffers are idle, otherwise they follow
+	 * the limits with their next use. */
+	if (RING_LEN(&ws->i_ring) == 0 && ws->i_state == STATE_I_HDR)
+		i_resize(ws, min);
+	if (ws->o_state == STATE_O_HDR && ws->o_off == 0)
+		o_resize(ws, min);
+	ws->i_full = ws->i_small = ws->o_full = ws->o_small = 0;
+
+	return 0;
+}
+
 void ws_set_bio(WebSocket *ws, void *ctx,
 		 ssize_t (*send)(void *ctx, const void *buf, size_t n),
 		 ssize_t (*recv)(void *ctx, void *buf, size_t n))
@@ -742,6 +1087,30 @@ void ws_set_bio(WebSocket *ws, void *ctx,
 	ws->recv = recv;
 }
 
+void ws_set_bio_splice(WebSocket *ws,
+		 ssize_t (*splice)(void *ctx, int fd, size_t n))
+{
+	ws->splice = splice;
+}
+
+void ws_set_bio_cork(WebSocket *ws, int (*cork)(void *ctx, int on))
+{
+	ws->cork = cork;
+}
+
+void ws_set_sink(WebSocket *ws, void *opaque,
+			int (*sink)(void *opaque, size_t n))
+{
+	ws->i_sopaque = opaque;
+	ws->i_sink    = sink;
+}
+
+void ws_set_bio_sendfile(WebSocket *ws,
+		 ssize_t (*sendfile)(void *ctx, int fd, off_t *off, size_t n))
+{
+	ws->sendfile = sendfile;
+}
+
 #define EQUAL(n, m)	((n) == (m))
 #define RANGE(n, l, h)	((n) >= (l) && (n) <= (h))
 #define TAIL(n)		RANGE(n, 0x80, 0xBF)
@@ -820,52 +1189,135 @@ static ssize_t utf8len(const unsigned char *buf, size_t n)
 	return p - buf;
 }
 
-static ssize_t
-ws_write(WebSocket *ws, unsigned char op, const void *buf, size_t n)
+CODEC unsigned char *put_hdr(unsigned char *p, unsigned char b0,
+			size_t n, unsigned char *msk, const int srv)
 {
-	unsigned char len, *p, q = 0;
+	unsigned char len;
 	size_t i;
-	int rc;
+
+	len = (n < 126) ? n : (n < 0x10000) ? 126 : 127;
+	*p++ = b0;
+	*p++ = (srv ? 0x00 : 0x80) | len;
+
+	if (len == 126) {
+		put_u16(p, n);
+		p += 2;
+	} else if (len == 127) {
+		put_u64(p, n);
+		p += 8;
+	}
+
+	if (!srv)
+		for (i = 0; i < 4; i++)
+			*p++ = msk[i] = rand() % 256;
+
+	return p;
+}
+
+/* Send buffered control frames. */
+static ssize_t ctrl_drain(WebSocket *ws)
+{
+	ssize_t rc;
+
+	while (ws->o_coff < ws->o_clen) {
+		rc = ws->send(ws->ctx, ws->o_cbuf + ws->o_coff,
+					ws->o_clen - ws->o_coff);
+		if (rc < 0)
+			return rc;
+		ws->o_coff += rc;
+	}
+
+	ws->o_coff = ws->o_clen = 0;
+
+	return 0;
+}
+
+static size_t frag_size(WebSocket *ws)
+{
+	size_t f = ws->o_frag, h;
+
+	if (ws->o_hint && (h = ws->o_hint(ws->ctx)) > 0)
+		f = h < WS_FRAG_MIN ? WS_FRAG_MIN : h;
+
+	return f > 0 && f < ws->o_lenall ? f : ws->o_lenall;
+}
+
+/* Account the sent chunk, 1 when the whole message is sent. */
+static int chunk_sent(WebSocket *ws)
+{
+	ws->o_offall += ws->o_len;
+	ws->o_lenall -= ws->o_len;
+	ws->o_flen   -= ws->o_len;
+	ws->o_off = 0;
+
+	if (ws->o_flen > 0) {
+		ws->o_state = STATE_O_PAYLOAD;
+	} else if (ws->o_lenall > 0) {
+		ws->o_state = STATE_O_FRAG;
+	} else {
+		ws->o_state = STATE_O_HDR;
+		/* The message is sent, the rest of control frames
+		 * (if any) waits for the next call, ws_flush() at least
+		 * (see ws.h). */
+		ctrl_drain(ws);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* The payload is either buf or n bytes of fd from off. */
+CODEC ssize_t send_msg(WebSocket *ws, unsigned char op, const void *buf,
+			int fd, off_t off, size_t n, const int srv)
+{
+	unsigned char *p, q = 0;
+	off_t o;
+	size_t f;
+	ssize_t rc;
 
 	while (!q) {
 		switch (ws->o_state) {
 		case STATE_O_HDR:
-			p = ws->o_buf;
-
-			len = (n < 126) ? n : (n < 0x10000) ? 126 : 127;
-			*p++ = 0x80 | op;
-			*p++ = (ws->srv ? 0x00 : 0x80) | len;
-
-			if (len == 126) {
-				put_u16(p, n);
-				p += 2;
-			} else if (len == 127) {
-				put_u64(p, n);
-				p += 8;
-			}
+			ws->o_offall = 0;
+			ws->o_lenall = n;
+			ws->o_state = STATE_O_FRAG;
+			/* THROUGH */
+		case STATE_O_FRAG:
+			/* Control frames preempt the rest of the message. */
+			rc = ctrl_drain(ws);
+			if (rc < 0)
+				return rc;
 
-			if (!ws->srv)
-				for (i = 0; i < 4; i++)
-					*p++ = ws->o_mskbuf[i] = rand() % 256;
+			f = frag_size(ws);
+			p = put_hdr(ws->o_buf,
+				(f == ws->o_lenall ? 0x80 : 0x00) |
+				(ws->o_offall > 0 ? OP_CONT : op),
+				f, ws->o_mskbuf, srv);
 
 			ws->o_off = p - ws->o_buf;
 			ws->o_imsk = 0;
-			ws->o_offall = 0;
-			ws->o_lenall = n;
+			ws->o_flen = f;
 			ws->o_state = STATE_O_PAYLOAD;
 			/* THROUGH */
 		case STATE_O_PAYLOAD:
+			if (buf != NULL)
+				o_adapt(ws);
 			assert(WS_O_BUF_LEN(ws) > 0);
-			assert(ws->o_lenall > 0);
-			ws->o_len = ws->o_lenall > WS_O_BUF_LEN(ws) ?
-					WS_O_BUF_LEN(ws) : ws->o_lenall;
-			memcpy(WS_O_BUF(ws), buf + ws->o_offall, ws->o_len);
-
-			if (!ws->srv) {
-				p = WS_O_BUF(ws);
-				for (i = 0; i < ws->o_len; i++)
-					p[i] ^= ws->o_mskbuf[ws->o_imsk++ % 4];
-			}
+			/* Only the header is buffered, the kernel sends
+			 * the file. */
+			ws->o_len = buf == NULL ? 0 :
+				    ws->o_flen > WS_O_BUF_LEN(ws) ?
+					WS_O_BUF_LEN(ws) : ws->o_flen;
+
+			if (ws->o_len == 0)
+				;
+			else if (srv)
+				memcpy(WS_O_BUF(ws), (unsigned char *)buf +
+						ws->o_offall, ws->o_len);
+			else
+				mask_copy(WS_O_BUF(ws), (unsigned char *)buf +
+						ws->o_offall, ws->o_len,
+						ws->o_mskbuf, &ws->o_imsk);
 
 			ws->o_off += ws->o_len;
 			ws->o_data = ws->o_buf;
@@ -873,24 +1325,35 @@ ws_write(WebSocket *ws, unsigned char op, const void *buf, size_t n)
 			ws->o_state = STATE_O_DRAIN;
 			/* THROUGH */
 		case STATE_O_DRAIN:
-			rc = ws->send(ws->ctx, ws->o_data, ws->o_left);
-			if (rc < 0)
-				return rc;
+			if (ws->o_left > 0) {
+				rc = ws->send(ws->ctx, ws->o_data, ws->o_left);
+				if (rc < 0)
+					return rc;
 
-			ws->o_data += rc;
-			ws->o_left -= rc;
-			if (ws->o_left > 0)
+				ws->o_data += rc;
+				ws->o_left -= rc;
+				if (ws->o_left > 0)
+					break;
+			}
+
+			if (buf == NULL && ws->o_flen > 0) {
+				ws->o_state = STATE_O_FILE;
 				break;
-			/* The current chunk is sent. */
-			ws->o_offall += ws->o_len;
-			ws->o_lenall -= ws->o_len;
-			if (ws->o_lenall > 0) {
-				ws->o_state = STATE_O_PAYLOAD;
-				ws->o_off = 0;
-			} else {
-				ws->o_state = STATE_O_HDR;
-				q = 1;
 			}
+			/* The current chunk is sent. */
+			q = chunk_sent(ws);
+			break;
+		case STATE_O_FILE:
+			o = off + ws->o_offall;
+			rc = ws->sendfile(ws->ctx, fd, &o, ws->o_flen);
+			if (rc < 0)
+				return rc;
+			/* The file is shorter than the frame says. */
+			if (rc == 0)
+				return WS_E_IO;
+
+			ws->o_len = rc;
+			q = chunk_sent(ws);
 			break;
 		default:
 			abort();
@@ -900,6 +1363,24 @@ ws_write(WebSocket *ws, unsigned char op, const void *buf, size_t n)
 	return n;
 }
 
+static ssize_t srv_send(WebSocket *ws, unsigned char op, const void *buf,
+			int fd, off_t off, size_t n)
+{
+	return send_msg(ws, op, buf, fd, off, n, 1);
+}
+
+static ssize_t usr_send(WebSocket *ws, unsigned char op, const void *buf,
+			int fd, off_t off, size_t n)
+{
+	return send_msg(ws, op, buf, fd, off, n, 0);
+}
+
+static ssize_t
+ws_write(WebSocket *ws, unsigned char op, const void *buf, size_t n)
+{
+	return ws->o_codec(ws, op, buf, -1, 0, n);
+}
+
 ssize_t ws_txt_write(WebSocket *ws, const void *buf, size_t n)
 {
 	ssize_t	rc;
@@ -924,6 +1405,200 @@ ssize_t ws_bin_write(WebSocket *ws, const void *buf, size_t n)
 	return ws_write(ws, OP_BIN, buf, n);
 }
 
+ssize_t ws_send_file(WebSocket *ws, int fd, off_t off, size_t n)
+{
+	struct stat st;
+	size_t pg, delta;
+	ssize_t rc;
+	void *p;
+
+	if (!n)
+		return 0;
+
+	/* Unmasked payload goes from the file to the socket directly. */
+	if (ws->srv && ws->sendfile)
+		return srv_send(ws, OP_BIN, NULL, fd, off, n);
+
+	/* Otherwise map the file and mask right from the mapping, the
+	 * mapping lives until the whole message is sent. */
+	if (!ws->o_map) {
+		/* Touching the mapping past the file's end is SIGBUS. */
+		if (fstat(fd, &st) < 0 || off < 0 ||
+		    (uintmax_t)off + n > (uintmax_t)st.st_size)
+			return WS_E_IO;
+		pg = sysconf(_SC_PAGESIZE);
+		delta = off % pg;
+		p = mmap(NULL, n + delta, PROT_READ, MAP_PRIVATE, fd, off - delta);
+		if (p == MAP_FAILED)
+			return WS_E_IO;
+		ws->o_map = p;
+		ws->o_maplen = n + delta;
+	}
+
+	delta = ws->o_maplen - n;
+	rc = ws_write(ws, OP_BIN, (unsigned char *)ws->o_map + delta, n);
+	if (rc != WS_E_WANT_WRITE) {
+		munmap(ws->o_map, ws->o_maplen);
+		ws->o_map = NULL;
+		ws->o_maplen = 0;
+	}
+
+	return rc;
+}
+
+static int b_charge(WebSocket *ws, size_t n)
+{
+	ws_budget *b = ws->b;
+
+	if (!b)
+		return 0;
+
+	if (__atomic_add_fetch(&b->used, n, __ATOMIC_RELAXED) > b->limit &&
+								b->limit) {
+		__atomic_sub_fetch(&b->used, n, __ATOMIC_RELAXED);
+		return WS_E_BUDGET;
+	}
+	ws->b_used += n;
+
+	return 0;
+}
+
+static void b_uncharge(WebSocket *ws, size_t n)
+{
+	if (ws->b) {
+		__atomic_sub_fetch(&ws->b->used, n, __ATOMIC_RELAXED);
+		ws->b_used -= n;
+	}
+}
+
+static ssize_t q_push(WebSocket *ws, unsigned char op, const void *buf,
+		size_t n, void (*release)(void *, const void *), void *arg)
+{
+	ws_qmsg *m;
+
+	if (ws->q_limit && ws->q_bytes + n > ws->q_limit)
+		return WS_E_QUEUE_LIMIT;
+
+	/* Referenced buffers are held by the queue too. */
+	if (b_charge(ws, sizeof(*m) + n) < 0)
+		return WS_E_BUDGET;
+
+	m = malloc(sizeof(*m) + (release ? 0 : n));
+	if (!m) {
+		b_uncharge(ws, sizeof(*m) + n);
+		return WS_E_QUEUE_LIMIT;
+	}
+
+	m->op = op;
+	m->n = n;
+	m->release = release;
+	m->arg = arg;
+	m->buf = release ? buf : memcpy(m + 1, buf, n);
+
+	m->next = NULL;
+	if (ws->q_tail)
+		ws->q_tail->next = m;
+	else
+		ws->q_head = m;
+	ws->q_tail = m;
+
+	ws->q_bytes += n;
+	if (!ws->q_above && ws->q_hiwat && ws->q_bytes >= ws->q_hiwat) {
+		ws->q_above = 1;
+		if (ws->q_wm)
+			ws->q_wm(ws->q_opaque, 1);
+	}
+
+	return n;
+}
+
+static void q_pop(WebSocket *ws)
+{
+	ws_qmsg *m = ws->q_head;
+
+	ws->q_head = m->next;
+	if (!ws->q_head)
+		ws->q_tail = NULL;
+	ws->q_bytes -= m->n;
+	b_uncharge(ws, sizeof(*m) + m->n);
+	if (m->release)
+		m->release(m->arg, m->buf);
+	free(m);
+
+	if (ws->q_above && ws->q_bytes <= ws->q_lowat) {
+		ws->q_above = 0;
+		if (ws->q_wm)
+			ws->q_wm(ws->q_opaque, 0);
+	}
+}
+
+/* Whether the frame which failed to go out is op with buf as payload. */
+static int ctrl_same(WebSocket *ws, unsigned char op,
+			const void *buf, size_t n)
+{
+	const unsigned char *p = ws->o_cbuf + ws->o_clast;
+	const unsigned char *q = buf;
+	size_t i, h = ws->srv ? 2 : 6;
+
+	if ((p[0] & 0x0F) != op || (p[1] & 0x7F) != n)
+		return 0;
+	for (i = 0; i < n; i++)
+		if ((p[h + i] ^ (ws->srv ? 0 : p[2 + i % 4])) != q[i])
+			return 0;
+
+	return 1;
+}
+
+static ssize_t ws_ctrl_write(WebSocket *ws, unsigned char op,
+				const void *buf, size_t n)
+{
+	unsigned char *p, msk[4];
+	size_t i = 0;
+	int busy;
+	ssize_t rc;
+
+	busy = ws->o_state != STATE_O_HDR || ws->q_head;
+
+	/* The caller repeats the frame which is already buffered, another
+	 * one is added after it. */
+	if (ws->o_cretry) {
+		if (ctrl_same(ws, op, buf, n)) {
+			if (!busy && (rc = ctrl_drain(ws)) < 0)
+				return rc;
+			ws->o_cretry = 0;
+			return 0;
+		}
+		ws->o_cretry = 0;
+	}
+
+	/* A full buffer is drained between data frames only, the caller
+	 * goes on with the message otherwise (see ws.h). */
+	if (ws->o_clen + 6 + n > WS_CTRL_SIZE) {
+		if (ws->o_state != STATE_O_HDR || (rc = ctrl_drain(ws)) < 0)
+			return WS_E_WANT_WRITE;
+	}
+
+	/* Don't touch the mask of the data frame being sent. */
+	ws->o_clast = ws->o_clen;
+	p = put_hdr(ws->o_cbuf + ws->o_clen, 0x80 | op, n, msk, ws->srv);
+	if (ws->srv)
+		memcpy(p, buf, n);
+	else
+		mask_copy(p, buf, n, msk, &i);
+	ws->o_clen = p + n - ws->o_cbuf;
+
+	/* The frame goes out between fragments of the current message. */
+	if (busy)
+		return 0;
+
+	if ((rc = ctrl_drain(ws)) < 0) {
+		ws->o_cretry = 1;
+		return rc;
+	}
+
+	return 0;
+}
+
 int ws_ping(WebSocket *ws, const void *buf, size_t n)
 {
 	ssize_t rc;
@@ -931,7 +1606,7 @@ int ws_ping(WebSocket *ws, const void *buf, size_t n)
 	if (n > 125)
 		return WS_E_TOO_LONG;
 
-	return (rc = ws_write(ws, OP_PING, buf, n)) < 0 ? rc : 0;
+	return (rc = ws_ctrl_write(ws, OP_PING, buf, n)) < 0 ? rc : 0;
 }
 
 int ws_pong(WebSocket *ws, const void *buf, size_t n)
@@ -941,7 +1616,7 @@ int ws_pong(WebSocket *ws, const void *buf, size_t n)
 	if (n > 125)
 		return WS_E_TOO_LONG;
 
-	return (rc = ws_write(ws, OP_PONG, buf, n)) < 0 ? rc : 0;
+	return (rc = ws_ctrl_write(ws, OP_PONG, buf, n)) < 0 ? rc : 0;
 }
 
 int ws_close(WebSocket *ws, uint16_t ecode, const void *msg, size_t n)
@@ -962,11 +1637,81 @@ int ws_close(WebSocket *ws, uint16_t ecode, const void *msg, size_t n)
 		memcpy(buf + 2, msg, n);
 	}
 
-	return (rc = ws_write(ws, OP_CLOSE, buf, n + 2)) < 0 ? rc : 0;
+	return (rc = ws_ctrl_write(ws, OP_CLOSE, buf, n + 2)) < 0 ? rc : 0;
 }
 
-static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
+ssize_t ws_queue_ref(WebSocket *ws, int txt, const void *buf, size_t n,
+			void (*release)(void *arg, const void *buf),
+			void *arg)
 {
+	ssize_t	rc;
+
+	if (!n)
+		return 0;
+
+	if (txt && ws->utf8_on) {
+		rc = utf8len(buf, n);
+		if (rc <= 0)
+			return rc == 0 ? WS_E_UTF8_INCOPMLETE : WS_E_NON_UTF8;
+		n = rc;
+	}
+
+	return q_push(ws, txt ? OP_TEXT : OP_BIN, buf, n, release, arg);
+}
+
+ssize_t ws_queue(WebSocket *ws, int txt, const void *buf, size_t n)
+{
+	return ws_queue_ref(ws, txt, buf, n, NULL, NULL);
+}
+
+int ws_flush(WebSocket *ws)
+{
+	ws_qmsg *m;
+	ssize_t rc = 0;
+	int cork = ws->cork && ws->q_head && ws->q_head->next;
+
+	if (cork)
+		ws->cork(ws->ctx, 1);
+
+	while ((m = ws->q_head) != NULL) {
+		rc = ws_write(ws, m->op, m->buf, m->n);
+		if (rc < 0)
+			break;
+		q_pop(ws);
+	}
+	if (rc >= 0)
+		rc = ctrl_drain(ws);
+
+	/* Whatever is held back goes out now. */
+	if (cork)
+		ws->cork(ws->ctx, 0);
+
+	return rc;
+}
+
+size_t ws_queued(WebSocket *ws)
+{
+	return ws->q_bytes;
+}
+
+void ws_set_queue_limit(WebSocket *ws, size_t limit)
+{
+	ws->q_limit = limit;
+}
+
+void ws_set_queue_watermarks(WebSocket *ws, size_t low, size_t high,
+				void *opaque, void (*wm)(void *opaque, int above))
+{
+	ws->q_lowat  = low;
+	ws->q_hiwat  = high;
+	ws->q_opaque = opaque;
+	ws->q_wm     = wm;
+}
+
+CODEC ssize_t
+handler(WebSocket *ws, union ws_arg *arg, int hnd, const int srv)
+{
+	struct ring *r = &ws->i_ring;
 	unsigned char b0, b1, fin, msk, op;
 	unsigned char *p;
 	size_t len, i, n;
@@ -976,12 +1721,13 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 	for (;;) {
 		switch (ws->i_state) {
 		case STATE_I_HDR:
-			rc = recvn(ws, 2);
+			rc = need(ws, 2);
 			if (rc <= 0)
 				return rc;
 
-			b0 = ws->i_buf[0];
-			b1 = ws->i_buf[1];
+			b0 = RING_RPTR(r)[0];
+			b1 = RING_RPTR(r)[1];
+			ring_consume(r, 2);
 
 			fin  = (b0 >> 7) & 0x01;
 			op   =  b0       & 0x0F;
@@ -1000,9 +1746,9 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 
 			msk = (b1 >>  7) & 0x01;
 			len =  b1        & 0x7F;
-			if (ws->srv && !msk)
+			if (srv && !msk)
 				return WS_E_EXPECT_MASK;
-			if (!ws->srv && msk)
+			if (!srv && msk)
 				return WS_E_UNEXPECTED_MASK;
 			/* Control frame is to long. */
 			if (CTRL(op) && len > 125)
@@ -1011,6 +1757,9 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 				return WS_E_BAD_LEN;
 			if (op == OP_CLOSE && len < 2)
 				return WS_E_FAULT_FRAME;
+			/* The last empty frame can't complete UTF-8. */
+			if (CONT(op) && fin && len == 0 && ws->i_ncarry)
+				return WS_E_NON_UTF8;
 
 			/* If the frame is not finished store the opcode. */
 			if (!fin && DATA(op))
@@ -1027,37 +1776,38 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 			ws->i_len = len < 126 ? len : 0;
 			ws->i_state = len == 126 ? STATE_I_PLEN16 :
 				      len == 127 ? STATE_I_PLEN64 :
-				(ws->srv ? STATE_I_MASK :
-				  ws->i_len == 0 ? STATE_I_CTRL : STATE_I_PAYLOAD0);
+				      srv    ? STATE_I_MASK : I_NEXT(ws);
 			break;
 		case STATE_I_MASK:
-			rc = recvn(ws, 4);
+			rc = need(ws, 4);
 			if (rc <= 0)
 				return rc;
 
-			memcpy(ws->i_mskbuf, ws->i_buf, 4);
+			memcpy(ws->i_mskbuf, RING_RPTR(r), 4);
+			ring_consume(r, 4);
 			ws->i_imsk = 0;
-			ws->i_state = ws->i_len == 0 ?
-					STATE_I_CTRL : STATE_I_PAYLOAD0;
+			ws->i_state = I_NEXT(ws);
 			break;
 		case STATE_I_PLEN16:
-			rc = recvn(ws, 2);
+			rc = need(ws, 2);
 			if (rc <= 0)
 				return rc;
 
-			len = get_u16(ws->i_buf);
+			len = get_u16(RING_RPTR(r));
+			ring_consume(r, 2);
 			if (len < 126)
 				return WS_E_BAD_LEN;
 
 			ws->i_len = len;
-			ws->i_state = ws->srv ? STATE_I_MASK : STATE_I_PAYLOAD0;
+			ws->i_state = srv ? STATE_I_MASK : STATE_I_PAYLOAD0;
 			break;
 		case STATE_I_PLEN64:
-			rc = recvn(ws, 8);
+			rc = need(ws, 8);
 			if (rc <= 0)
 				return rc;
 
-			m = get_u64(ws->i_buf);
+			m = get_u64(RING_RPTR(r));
+			ring_consume(r, 8);
 			if (m < 0x10000)
 				return WS_E_BAD_LEN;
 			if (m > 0x7FFFFFFFFFFFFFFF || m > SIZE_MAX)
@@ -1065,39 +1815,76 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 
 			len = (size_t)m;
 			ws->i_len = len;
-			ws->i_state = ws->srv ? STATE_I_MASK : STATE_I_PAYLOAD0;
+			ws->i_state = srv ? STATE_I_MASK : STATE_I_PAYLOAD0;
 			break;
 		case STATE_I_PAYLOAD0:
 			assert(ws->i_len > 0);
 			if (ws->limit && ws->i_len > ws->limit)
 				return WS_E_TOO_LONG;
+			ws->i_pend = 0;
 			ws->i_state = STATE_I_PAYLOAD;
-			/* THROUGH */
+			if (ws->op == OP_BIN && ws->i_sink &&
+			    (ws->i_sfd = ws->i_sink(ws->i_sopaque,
+						    ws->i_len)) >= 0)
+				ws->i_state = STATE_I_SINK;
+			break;
 		case STATE_I_PAYLOAD:
 			assert(ws->i_len > 0);
-			len = ws->i_len > WS_I_BUF_LEN(ws) ?
-					WS_I_BUF_LEN(ws) : ws->i_len;
-
-			rc = ws->recv(ws->ctx, WS_I_BUF(ws), len);
-			if (rc <= 0)
-				return rc == 0 ? WS_E_EOF : rc;
+			n = RING_LEN(r) < ws->i_len ? RING_LEN(r) : ws->i_len;
+			/* Nothing new is buffered or a control frame is
+			 * incomplete (it is read as a whole). */
+			if (n < ws->i_len && (n == ws->i_pend || CTRL(ws->op))) {
+				rc = fill(ws);
+				if (rc <= 0)
+					return rc;
+				continue;
+			}
 
-			if (ws->srv) {
-				p = WS_I_BUF(ws);
-				for (i = 0; i < (size_t)rc; i++)
-					p[i] ^= ws->i_mskbuf[ws->i_imsk++ % 4];
+			/* i_pend bytes are already unmasked. */
+			if (srv) {
+				p = RING_RPTR(r) + ws->i_pend;
+				mask_copy(p, p, n - ws->i_pend,
+					  ws->i_mskbuf, &ws->i_imsk);
 			}
+			ws->i_pend = n;
+
+			if (ws->i_ncarry > 0 && !CTRL(ws->op)) {
+				/* Complete UTF-8 character which is split
+				 * between continuation frames. */
+				p = RING_RPTR(r);
+				for (i = 0; i < n; i++) {
+					if (utf8(ws->i_carry, NULL,
+						 ws->i_ncarry) <= 0)
+						break;
+					ws->i_carry[ws->i_ncarry++] = p[i];
+				}
+				ring_consume(r, i);
+				ws->i_pend -= i;
+				ws->i_len  -= i;
 
-			ws->i_off += rc;
-			ws->i_len -= rc;
+				rc = utf8(ws->i_carry, NULL, ws->i_ncarry);
+				if (rc < 0)
+					return WS_E_NON_UTF8;
+				if (rc > 0) {
+					if (ws->i_len == 0) {
+						if (!ws->cont)
+							return WS_E_NON_UTF8;
+						ws->i_state = STATE_I_HDR;
+					}
+					continue;
+				}
 
-			assert(WS_BUF_SIZE >= 125);
-			/* Read a whole control frame. */
-			if (CTRL(ws->op) && ws->i_len > 0)
-				continue;
+				ws->i_data = ws->i_carry;
+				ws->i_left = ws->i_ncarry;
+				ws->i_ncarry = 0;
+				ws->i_incarry = 1;
+				ws->i_state = STATE_I_DRAIN;
+				break;
+			}
 
-			ws->i_data = ws->i_buf;
-			ws->i_left = ws->i_off;
+			ws->i_data = RING_RPTR(r);
+			ws->i_left = n;
+			ws->i_incarry = 0;
 
 			if (ws->op == OP_CLOSE) {
 				ws->ecode = get_u16(ws->i_data);
@@ -1116,10 +1903,17 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 				/* i_left may be truncated because of
 				 * partial UTF-8 character. */
 				if (!rc) {
-					if (ws->i_len == 0) {
-						if (!ws->cont)
+					if (n == ws->i_len) {
+						if (CTRL(ws->op) || !ws->cont)
 							return WS_E_NON_UTF8;
-						/* CONT may be uncompleted. */
+						/* CONT may be uncompleted,
+						 * carry the partial character
+						 * over the next frame header. */
+						memcpy(ws->i_carry, ws->i_data,
+								ws->i_left);
+						ws->i_ncarry = ws->i_left;
+						ring_consume(r, n);
+						ws->i_len = ws->i_pend = 0;
 						ws->i_state = STATE_I_HDR;
 					}
 					continue;
@@ -1138,39 +1932,72 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 			assert (CTRL(ws->op));
 			ws->ctrlsz = ws->i_left;
 			ws->ctrl = ws->i_left > 0 ? ws->i_data : NULL;
-			ws->i_off = ws->i_left = 0;
+			/* The payload stays in place until the next read. */
+			ring_consume(r, ws->i_len);
+			ws->i_len = ws->i_pend = ws->i_left = 0;
 			ws->i_state = STATE_I_HDR;
 			return ws->op == OP_CLOSE ? WS_E_OP_CLOSE :
 			       ws->op == OP_PING  ? WS_E_OP_PING :
 						    WS_E_OP_PONG;
 		case STATE_I_DRAIN:
 			if (hnd) {
-				n = 0;
+				n = ws->i_left;
 				arg->h.hnd(arg->h.opaque, ws->i_data,
-						ws->i_left, ws->op == OP_TEXT);
-				ws->i_data += ws->i_left;
-				ws->i_left = 0;
+						n, ws->op == OP_TEXT);
 			} else {
 				n = ws->i_left > arg->r.n ? arg->r.n : ws->i_left;
 				memcpy(arg->r.buf, ws->i_data, n);
 				*arg->r.txt = ws->op == OP_TEXT;
-				ws->i_data += n;
-				ws->i_left -= n;
 			}
 
-			if (ws->i_left == 0) {
-				/* Partial UTF-8 sequence (1-3 bytes). */
-				size_t left = ws->i_buf + ws->i_off - ws->i_data;
-				if (left > 0)
-					memmove(ws->i_buf, ws->i_data, left);
-				ws->i_off = left;
+			ws->i_data += n;
+			ws->i_left -= n;
+			/* The carried character is already consumed. */
+			if (!ws->i_incarry) {
+				ring_consume(r, n);
+				ws->i_pend -= n;
+				ws->i_len  -= n;
+			}
+
+			if (ws->i_left == 0)
 				ws->i_state = ws->i_len > 0 ?
 					STATE_I_PAYLOAD : STATE_I_HDR;
-			}
 
 			if (hnd)
 				break;
 			return (ssize_t)n;
+		case STATE_I_SINK:
+			n = RING_LEN(r) < ws->i_len ? RING_LEN(r) : ws->i_len;
+			if (n > 0) {
+				/* Buffered payload goes out first. */
+				p = RING_RPTR(r);
+				if (srv)
+					mask_copy(p + ws->i_pend, p + ws->i_pend,
+						  n - ws->i_pend, ws->i_mskbuf,
+						  &ws->i_imsk);
+				ws->i_pend = n;
+				rc = write(ws->i_sfd, p, n);
+				if (rc < 0)
+					return SOFT_ERROR ? WS_E_WANT_WRITE :
+							    WS_E_IO;
+				ring_consume(r, rc);
+				ws->i_pend -= rc;
+			} else if (!srv && ws->splice) {
+				/* Unmasked payload is moved by the kernel. */
+				rc = ws->splice(ws->ctx, ws->i_sfd, ws->i_len);
+				if (rc <= 0)
+					return rc == 0 ? WS_E_EOF : rc;
+			} else {
+				rc = fill(ws);
+				if (rc <= 0)
+					return rc;
+				continue;
+			}
+
+			ws->i_len -= rc;
+			if (ws->i_len == 0)
+				ws->i_state = STATE_I_HDR;
+			break;
 		default:
 			abort();
 		}
@@ -1179,13 +2006,240 @@ static ssize_t ws_handler(WebSocket *ws, union ws_arg *arg, int hnd)
 	return -1;
 }
 
+static ssize_t srv_handler(WebSocket *ws, union ws_arg *arg, int hnd)
+{
+	return handler(ws, arg, hnd, 1);
+}
+
+static ssize_t usr_handler(WebSocket *ws, union ws_arg *arg, int hnd)
+{
+	return handler(ws, arg, hnd, 0);
+}
+
+CODEC int frame_hdr(WebSocket *ws, const int srv)
+{
+	struct ring *r = &ws->i_ring;
+	unsigned char b0, b1, op, *p;
+	size_t len, h;
+	uint64_t m;
+	ssize_t rc;
+
+	rc = need(ws, 2);
+	if (rc <= 0)
+		return rc;
+
+	b0 = RING_RPTR(r)[0];
+	b1 = RING_RPTR(r)[1];
+	op = b0 & 0x0F;
+	len = b1 & 0x7F;
+
+	if (!check_op(op))
+		return WS_E_BAD_OPCODE;
+	/* Control frames are neither fragmented nor long. */
+	if (CTRL(op) && !(b0 & 0x80))
+		return WS_E_FAULT_FRAME;
+	if (CTRL(op) && len > 125)
+		return WS_E_BAD_LEN;
+	if ((CONT(op) && !ws->cont) || (ws->cont && DATA(op)))
+		return WS_E_FAULT_FRAME;
+	if (srv && !(b1 & 0x80))
+		return WS_E_EXPECT_MASK;
+	if (!srv && (b1 & 0x80))
+		return WS_E_UNEXPECTED_MASK;
+
+	/* The whole header at once. */
+	h = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + (srv ? 4 : 0);
+	rc = need(ws, h);
+	if (rc <= 0)
+		return rc;
+
+	p = RING_RPTR(r) + 2;
+	if (len == 126) {
+		len = get_u16(p);
+		p += 2;
+		if (len < 126)
+			return WS_E_BAD_LEN;
+	} else if (len == 127) {
+		m = get_u64(p);
+		p += 8;
+		if (m < 0x10000 || m > 0x7FFFFFFFFFFFFFFF || m > SIZE_MAX)
+			return WS_E_BAD_LEN;
+		len = (size_t)m;
+	}
+	if (ws->limit && len > ws->limit)
+		return WS_E_TOO_LONG;
+
+	if (srv) {
+		memcpy(ws->i_mskbuf, p, 4);
+		ws->i_imsk = 0;
+	}
+	ring_consume(r, h);
+
+	if (DATA(op) && !(b0 & 0x80))
+		ws->cont = op;
+	else if (CONT(op) && (b0 & 0x80))
+		ws->cont = 0;
+
+	ws->i_b0 = b0;
+	ws->i_flen = ws->i_len = len;
+	ws->i_state = STATE_I_FRAME;
+
+	return 1;
+}
+
+CODEC int frame_read(WebSocket *ws, ws_frame *f, const int srv)
+{
+	struct ring *r = &ws->i_ring;
+	unsigned char *p;
+	size_t n;
+	int raw;
+	ssize_t rc;
+
+	/* The previous segment is consumed now. */
+	ring_consume(r, ws->i_left);
+	ws->i_left = 0;
+
+	if (ws->i_state == STATE_I_HDR && (rc = frame_hdr(ws, srv)) <= 0)
+		return rc;
+
+	/* A control frame is returned as a whole. */
+	while (RING_LEN(r) < (CTRL(ws->i_b0 & 0x0F) ? ws->i_len : 1) &&
+								ws->i_len)
+		if ((rc = fill(ws)) <= 0)
+			return rc;
+
+	n = RING_LEN(r) < ws->i_len ? RING_LEN(r) : ws->i_len;
+	p = RING_RPTR(r);
+	raw = srv && ws->i_raw && !CTRL(ws->i_b0 & 0x0F);
+	if (srv && !raw)
+		mask_copy(p, p, n, ws->i_mskbuf, &ws->i_imsk);
+
+	f->fin = ws->i_b0 >> 7;
+	f->rsv = (ws->i_b0 >> 4) & 0x07;
+	f->op  = ws->i_b0 & 0x0F;
+	f->len = ws->i_flen;
+	f->off = ws->i_flen - ws->i_len;
+	f->buf = p;
+	f->n   = n;
+	f->msk = raw ? ws->i_mskbuf : NULL;
+
+	ws->i_left = n;
+	ws->i_len -= n;
+	if (ws->i_len == 0)
+		ws->i_state = STATE_I_HDR;
+
+	return 0;
+}
+
+int ws_read_frame(WebSocket *ws, ws_frame *f)
+{
+	return ws->srv ? frame_read(ws, f, 1) : frame_read(ws, f, 0);
+}
+
+void ws_set_frame_raw(WebSocket *ws, int v)
+{
+	ws->i_raw = v ? 1 : 0;
+}
+
+CODEC int frame_write(WebSocket *ws, const ws_frame *f, const int srv)
+{
+	unsigned char *p, key[4];
+	size_t n, i;
+	ssize_t rc;
+
+	for (;;) {
+		switch (ws->o_state) {
+		case STATE_O_HDR:
+			/* Control frames go out between frames. */
+			rc = ctrl_drain(ws);
+			if (rc < 0)
+				return rc;
+
+			p = put_hdr(ws->o_buf, (f->fin ? 0x80 : 0x00) |
+				    (f->rsv & 0x07) << 4 | (f->op & 0x0F),
+				    f->len, ws->o_mskbuf, srv);
+			ws->o_off = p - ws->o_buf;
+			ws->o_imsk = 0;
+			ws->o_offall = 0;
+			ws->o_state = STATE_O_PAYLOAD;
+			break;
+		case STATE_O_FRAG:
+			/* The next segment of the same frame. */
+			ws->o_off = 0;
+			ws->o_offall = 0;
+			ws->o_state = STATE_O_PAYLOAD;
+			break;
+		case STATE_O_PAYLOAD:
+			n = f->n - ws->o_offall;
+			if (srv && !f->msk && ws->o_off == 0 &&
+			    n > WS_O_BUF_LEN(ws)) {
+				/* Big unmasked payload goes as it is. */
+				ws->o_data = (unsigned char *)f->buf +
+							ws->o_offall;
+				ws->o_left = n;
+			} else {
+				if (n > WS_O_BUF_LEN(ws))
+					n = WS_O_BUF_LEN(ws);
+				/* Both masks start with the frame, the
+				 * combined key has the same phase. */
+				for (i = 0; f->msk && i < 4; i++)
+					key[i] = f->msk[i] ^
+						 (srv ? 0 : ws->o_mskbuf[i]);
+				if (srv && !f->msk)
+					memcpy(WS_O_BUF(ws), (unsigned char *)
+						f->buf + ws->o_offall, n);
+				else
+					mask_copy(WS_O_BUF(ws), (unsigned char *)
+						f->buf + ws->o_offall, n,
+						f->msk ? key : ws->o_mskbuf,
+						&ws->o_imsk);
+				ws->o_data = ws->o_buf;
+				ws->o_left = ws->o_off + n;
+			}
+			ws->o_offall += n;
+			ws->o_state = STATE_O_DRAIN;
+			/* THROUGH */
+		case STATE_O_DRAIN:
+			while (ws->o_left > 0) {
+				rc = ws->send(ws->ctx, ws->o_data, ws->o_left);
+				if (rc < 0)
+					return rc;
+				ws->o_data += rc;
+				ws->o_left -= rc;
+			}
+
+			ws->o_off = 0;
+			if (ws->o_offall < f->n) {
+				ws->o_state = STATE_O_PAYLOAD;
+				break;
+			}
+
+			/* Control frames wait until the frame is complete. */
+			if (f->off + f->n < f->len) {
+				ws->o_state = STATE_O_FRAG;
+				return 0;
+			}
+			ws->o_state = STATE_O_HDR;
+			ctrl_drain(ws);
+			return 0;
+		default:
+			abort();
+		}
+	}
+}
+
+int ws_write_frame(WebSocket *ws, const ws_frame *f)
+{
+	return ws->srv ? frame_write(ws, f, 1) : frame_write(ws, f, 0);
+}
+
 ssize_t ws_read(WebSocket *ws, void *buf, size_t n, int *txt)
 {
 	union ws_arg arg;
 	arg.r.buf = buf;
 	arg.r.n   = n;
 	arg.r.txt = txt;
-	return ws_handler(ws, &arg, 0);
+	return ws->i_codec(ws, &arg, 0);
 }
 
 int ws_parse(WebSocket *ws, void *opaque,
@@ -1194,7 +2248,7 @@ int ws_parse(WebSocket *ws, void *opaque,
 	union ws_arg arg;
 	arg.h.hnd    = hnd;
 	arg.h.opaque = opaque;
-	return ws_handler(ws, &arg, 1);
+	return ws->i_codec(ws, &arg, 1);
 }
 
 void ws_set_data_limit(WebSocket *ws, size_t limit)
@@ -1202,6 +2256,12 @@ void ws_set_data_limit(WebSocket *ws, size_t limit)
 	ws->limit = limit;
 }
 
+void ws_set_frag(WebSocket *ws, size_t size, size_t (*hint)(void *ctx))
+{
+	ws->o_frag = size;
+	ws->o_hint = hint;
+}
+
 void ws_set_check_utf8(WebSocket *ws, int v)
 {
 	ws->utf8_on = v ? 1 : 0;
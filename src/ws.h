@@ -1,17 +1,86 @@
 #ifndef WS_H
 #define WS_H
 
+#include "ring.h"
+
+/* The default size of both buffers, see ws_set_buf_size(). */
 #ifndef WS_BUF_SIZE
 #  define WS_BUF_SIZE		8192
 #endif
 
+/* The output buffer must fit the handshake. */
+#ifndef WS_BUF_MIN
+#  define WS_BUF_MIN		1024
+#endif
+
+/* Room for control frames which wait for a fragment boundary. */
+#ifndef WS_CTRL_SIZE
+#  define WS_CTRL_SIZE		512
+#endif
+
+/* The smallest fragment a hint can ask for. */
+#ifndef WS_FRAG_MIN
+#  define WS_FRAG_MIN		1024
+#endif
+
+/* Opcodes as they are on the wire. */
+#define WS_OP_CONT		0x00
+#define WS_OP_TEXT		0x01
+#define WS_OP_BIN		0x02
+#define WS_OP_CLOSE		0x08
+#define WS_OP_PING		0x09
+#define WS_OP_PONG		0x0A
+
 typedef struct WebSocket WebSocket;
+typedef struct ws_frame ws_frame;
+typedef struct ws_qmsg ws_qmsg;
+typedef struct ws_budget ws_budget;
+union ws_arg;
+
+/* A frame as it is on the wire, or a segment of its payload. */
+struct ws_frame {
+	unsigned char	fin;
+	unsigned char	rsv;	/* RSV1-3 as bits 2-0. */
+	unsigned char	op;	/* WS_OP_CONT for continuation frames. */
+	size_t		len;	/* The whole payload. */
+	size_t		off;	/* Offset of this segment in the payload. */
+	const void	*buf;	/* Segment inside the input buffer. */
+	size_t		n;
+	/* NULL or the key buf is still masked with (see
+	 * ws_set_frame_raw()), the key applies from the frame's start. */
+	const unsigned char *msk;
+};
+
+struct ws_qmsg {
+	ws_qmsg		*next;
+	unsigned char	op;
+	const void	*buf;
+	size_t		n;
+	void		(*release)(void *arg, const void *buf);
+	void		*arg;
+};
+
+/* Memory and connections shared by a group of WebSockets. It is updated
+ * atomically, so it may live in MAP_SHARED memory of pre-forked servers. */
+struct ws_budget {
+	size_t		limit;
+	size_t		used;
+	unsigned int	max_conns;
+	unsigned int	conns;
+};
 
 struct WebSocket {
 	void		*ctx;
 	ssize_t		(*recv)(void *ctx, void *buf, size_t n);
 	ssize_t		(*send)(void *ctx, const void *buf, size_t n);
+	ssize_t		(*sendfile)(void *ctx, int fd, off_t *off, size_t n);
+	ssize_t		(*splice)(void *ctx, int fd, size_t n);
+	int		(*cork)(void *ctx, int on);
 	unsigned char	srv;
+	/* Role specialized codec, set by ws_init(). */
+	ssize_t		(*i_codec)(WebSocket *ws, union ws_arg *arg, int hnd);
+	ssize_t		(*o_codec)(WebSocket *ws, unsigned char op,
+				   const void *buf, int fd, off_t off, size_t n);
 	unsigned char	op;
 	unsigned char	cont;
 	unsigned char	utf8_on;
@@ -22,15 +91,27 @@ struct WebSocket {
 	char		*sec;
 	size_t		limit;
 	int		h_state;
+	size_t		h_max;
+	unsigned int	h_tmo;
+	long long	h_deadline;
 
 	int		i_state;
 	size_t		i_imsk;
 	unsigned char	i_mskbuf[4];
 	size_t		i_len;
-	unsigned char	*i_buf;
-	size_t		i_off;
+	struct ring	i_ring;
+	size_t		i_pend;
+	unsigned char	i_carry[4];
+	unsigned char	i_ncarry;
+	unsigned char	i_incarry;
 	unsigned char	*i_data;
 	size_t		i_left;
+	int		i_sfd;
+	void		*i_sopaque;
+	int		(*i_sink)(void *opaque, size_t n);
+	unsigned char	i_b0;
+	unsigned char	i_raw;
+	size_t		i_flen;
 
 	int		o_state;
 	size_t		o_imsk;
@@ -42,6 +123,37 @@ struct WebSocket {
 	size_t		o_left;
 	size_t		o_offall;
 	size_t		o_lenall;
+	size_t		o_flen;
+	size_t		o_frag;
+	size_t		(*o_hint)(void *ctx);
+	unsigned char	*o_cbuf;
+	size_t		o_clen;
+	size_t		o_coff;
+	size_t		o_clast;
+	unsigned char	o_cretry;
+	void		*o_map;
+	size_t		o_maplen;
+
+	ws_budget	*b;
+	size_t		b_used;
+
+	size_t		buf_min;
+	size_t		buf_max;
+	unsigned int	i_full;
+	unsigned int	i_small;
+	size_t		o_size;
+	unsigned int	o_full;
+	unsigned int	o_small;
+
+	ws_qmsg		*q_head;
+	ws_qmsg		*q_tail;
+	size_t		q_bytes;
+	size_t		q_limit;
+	size_t		q_lowat;
+	size_t		q_hiwat;
+	unsigned char	q_above;
+	void		*q_opaque;
+	void		(*q_wm)(void *opaque, int above);
 };
 
 /* 0 in case of success and -1 in case of failure. */
@@ -55,12 +167,34 @@ void ws_deinit(WebSocket *ws);
 int ws_handshake(WebSocket *ws, const char *host,
 				const char *uri, const char *uhdrs);
 
+/* The handshake fails with WS_E_HTTP_HDR_LIMIT when the HTTP header is
+ * longer than hdr_max and with WS_E_TIMEOUT when it takes more than tmo
+ * milliseconds since the first ws_handshake() call (0 means no limit). */
+void ws_set_handshake_limit(WebSocket *ws, size_t hdr_max, unsigned int tmo);
+
+/* Milliseconds left till the handshake deadline, -1 if there is none.
+ * Use it as the poll() timeout, ws_handshake() then reports WS_E_TIMEOUT. */
+int ws_handshake_timeout(WebSocket *ws);
+
+/* Write a static "400 Bad Request" or "503 Service Unavailable" (busy)
+ * response. Only the bio is needed, so the caller may reject without
+ * ws_init() on a zeroed WebSocket. 0 in case of success or < 0, call it
+ * again on WS_E_WANT_WRITE. */
+int ws_reject(WebSocket *ws, int busy);
+
 /* ws_txt_write() may send less than n if the buf contains an incomplete
  * UTF-8 character at the buf's end. */
 ssize_t ws_txt_write(WebSocket *ws, const void *buf, size_t n);
 
 ssize_t ws_bin_write(WebSocket *ws, const void *buf, size_t n);
 
+/* Send n bytes of fd from off as a binary message. A server with
+ * the sendfile bio writes the frame header and lets the kernel send the
+ * payload, a client masks the payload right from the file's mapping.
+ * Like ws_*_write() call it again with the same arguments on
+ * WS_E_WANT_WRITE. WS_E_IO if the file is shorter than off + n. */
+ssize_t ws_send_file(WebSocket *ws, int fd, off_t off, size_t n);
+
 /* ws_read and ws_parse garantie to return utf8 complete
  * data for TEXT frame. */
 ssize_t ws_read(WebSocket *ws, void *buf, size_t n, int *txt);
@@ -68,18 +202,129 @@ ssize_t ws_read(WebSocket *ws, void *buf, size_t n, int *txt);
 int ws_parse(WebSocket *ws, void *opaque,
 	     void (*hnd)(void *opaque, const void *buf, size_t n, int txt));
 
+/* Frame level interface for intermediaries, don't mix it with the message
+ * level one on the same direction. ws_read_frame() fills f with the next
+ * frame or the next segment of its payload as it is buffered, 0 in case of
+ * success or < 0. The segment stays in the input buffer till the next
+ * call. Fragmentation, masks and lengths are checked, but the payload is
+ * not validated (neither UTF-8 nor close codes) and control frames are
+ * returned too, always as a whole. */
+int ws_read_frame(WebSocket *ws, ws_frame *f);
+
+/* With v != 0 a server's ws_read_frame() leaves data payloads masked and
+ * sets f->msk, ws_write_frame() then unmasks and remasks in one pass. */
+void ws_set_frame_raw(WebSocket *ws, int v);
+
+/* Write a frame or a segment described by f, a segment with f->off == 0
+ * starts a new frame with f's flags and f->len bytes of payload. A client
+ * masks the payload with its own mask, a server sends big unmasked
+ * segments right from f->buf. A masked f->buf is unmasked on the fly.
+ * 0 in case of success or < 0, call it again with the same f on
+ * WS_E_WANT_WRITE. ws_ping(), ws_pong() and ws_close() go out between
+ * frames. */
+int ws_write_frame(WebSocket *ws, const ws_frame *f);
+
 /* For ping, pong, close 0 in case of success or < 0 in case of
- * failure (see err code below). */
+ * failure (see err code below). If a data message is being sent the
+ * control frame is buffered and goes out between its fragments. What
+ * is still buffered when the message completes is left for the next
+ * call, so call ws_flush() then, it returns WS_E_WANT_WRITE till the
+ * socket takes them all. On WS_E_WANT_WRITE call them again with the
+ * same arguments, in the middle of a message only after the message
+ * (or ws_flush()) has made progress, nothing else drains the buffer. */
 int ws_ping(WebSocket *ws, const void *buf, size_t n);
 int ws_pong(WebSocket *ws, const void *buf, size_t n);
 int ws_close(WebSocket *ws, uint16_t ecode, const void *msg, size_t n);
 
+/* The send queue takes the ownership of outgoing messages and returns
+ * immediately, ws_flush() sends them when the socket is writable.
+ * ws_queue() copies the buffer, ws_queue_ref() keeps the pointer and calls
+ * release(arg, buf) once the message is sent or dropped. Both return the
+ * queued length which for a text message may be less than n (see
+ * ws_txt_write()) or < 0 in case of failure, WS_E_QUEUE_LIMIT means
+ * the consumer is too slow and should be disconnected. Don't mix the queue
+ * with ws_*_write(), ws_ping(), ws_pong() and ws_close() are sent by
+ * ws_flush() between fragments while the queue is not empty. */
+ssize_t ws_queue(WebSocket *ws, int txt, const void *buf, size_t n);
+ssize_t ws_queue_ref(WebSocket *ws, int txt, const void *buf, size_t n,
+			void (*release)(void *arg, const void *buf),
+			void *arg);
+
+/* 0 when the queue is empty or < 0 (WS_E_WANT_WRITE if the socket is not
+ * writable). */
+int ws_flush(WebSocket *ws);
+
+/* Queued bytes. */
+size_t ws_queued(WebSocket *ws);
+
+/* 0 means no limit. */
+void ws_set_queue_limit(WebSocket *ws, size_t limit);
+
+/* wm(opaque, 1) is called when the queue grows to high and wm(opaque, 0)
+ * when it drains to low. */
+void ws_set_queue_watermarks(WebSocket *ws, size_t low, size_t high,
+				void *opaque, void (*wm)(void *opaque, int above));
+
+/* 0 means no limit. */
+void ws_budget_init(ws_budget *b, size_t limit, unsigned int max_conns);
+
+/* 0 if one more connection fits into the budget or WS_E_BUDGET, call it
+ * before ws_init() and answer ws_reject(ws, 1) when it's exhausted. */
+int ws_budget_admit(ws_budget *b);
+
+/* Attach ws to b (or detach it with NULL). The buffers and the send queue
+ * are charged to b, ws_queue() fails with WS_E_BUDGET when b is exhausted
+ * and ws_deinit() gives everything back. */
+void ws_set_budget(WebSocket *ws, ws_budget *b);
+
+/* 1 when b is exhausted and ws holds more than an average connection,
+ * closing such connections first sheds the heaviest consumers. */
+int ws_budget_shed(WebSocket *ws);
+
+/* The input and output buffers start with min bytes, double after a few
+ * reads or frames in a row fill them and halve after a longer run of
+ * small traffic, never beyond max. Both are WS_BUF_SIZE by default. The
+ * growth stops and the buffers shrink while the budget is exhausted.
+ * Call it before the handshake, 0 in case of success or -1. */
+int ws_set_buf_size(WebSocket *ws, size_t min, size_t max);
+
 void ws_set_bio(WebSocket *ws, void *ctx,
 		 ssize_t (*send)(void *ctx, const void *buf, size_t n),
 		 ssize_t (*recv)(void *ctx, void *buf, size_t n));
 
+/* Optional, sendfile(ctx, fd, off, n) sends up to n bytes of fd from *off
+ * and advances *off, returns the number of bytes or < 0 like send(). */
+void ws_set_bio_sendfile(WebSocket *ws,
+		 ssize_t (*sendfile)(void *ctx, int fd, off_t *off, size_t n));
+
+/* Optional, splice(ctx, fd, n) moves up to n bytes from the connection
+ * to fd, returns the number of bytes or < 0 like recv(). It may hold
+ * back what fd doesn't take, returns WS_E_WANT_WRITE then and counts the
+ * bytes when they reach fd. */
+void ws_set_bio_splice(WebSocket *ws,
+		 ssize_t (*splice)(void *ctx, int fd, size_t n));
+
+/* Optional, cork(ctx, 1) and cork(ctx, 0) bracket a ws_flush() of more
+ * than one message, so the transport may hold partial segments back
+ * (TCP_CORK). */
+void ws_set_bio_cork(WebSocket *ws, int (*cork)(void *ctx, int on));
+
+/* sink(opaque, n) is called when a binary frame with n bytes of payload
+ * starts. If it returns fd >= 0 ws_read() and ws_parse() put the payload
+ * into fd instead of returning it (with the splice bio a client's
+ * payload doesn't enter user space) and go on with the next frame. A full
+ * non-blocking fd makes them return WS_E_WANT_WRITE. */
+void ws_set_sink(WebSocket *ws, void *opaque,
+			int (*sink)(void *opaque, size_t n));
+
 void ws_set_data_limit(WebSocket *ws, size_t limit);
 
+/* Data messages longer than size are sent as fragments (0 disables it),
+ * so pending control frames don't wait for the whole message. If hint is
+ * set it is called with the bio context before every fragment and
+ * a non-zero result overrides size (but not less than WS_FRAG_MIN). */
+void ws_set_frag(WebSocket *ws, size_t size, size_t (*hint)(void *ctx));
+
 /* UTF-8 check is enabled by default. */
 void ws_set_check_utf8(WebSocket *ws, int v);
 
@@ -104,5 +349,9 @@ void ws_set_check_utf8(WebSocket *ws, int v);
 #define WS_E_TOO_LONG		-0x1012
 #define WS_E_UTF8_INCOPMLETE	-0x1013
 #define WS_E_HTTP_REQ_URI	-0x1014
+#define WS_E_QUEUE_LIMIT	-0x1015
+#define WS_E_HTTP_HDR_LIMIT	-0x1016
+#define WS_E_TIMEOUT		-0x1017
+#define WS_E_BUDGET		-0x1018
 
 #endif /* WS_H */
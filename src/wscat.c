@@ -1,5 +1,15 @@
+#ifdef __linux__
+#  define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,21 +22,85 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#endif
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#  define HAVE_SPLICE
+#endif
 
 #include "common.h"
 #include "inet.h"
 #include "ws.h"
+#include "pool.h"
+#include "inbox.h"
+#include "bcast.h"
+#include "cap.h"
+#ifdef WS_TLS
+#  include "tls.h"
+#endif
 
 #define DEFAULT_URI	"/cat"
 #define PING_TIMEOUT	3
+/* Pings in flight which a pong still matches. */
+#define PING_MAX	8
+#define PING_SIZE	32
+/* RTT histogram buckets, log2 ranges of 2^RTT_SUB linear steps. */
+#define RTT_SUB		3
+#define RTT_BUCKETS	(64 << RTT_SUB)
 #define CLOSE_TIMEOUT	5
+#define STAGE_SIZE	65536
+/* stdin stops above QUEUE_HIGH queued bytes and goes on below QUEUE_LOW. */
+#define QUEUE_LOW	(64 << 10)
+#define QUEUE_HIGH	(256 << 10)
+#define CTRL_PENDING	4
+#define POOL_SIZE	4
+#define LISTEN_MAX	8
+#define HS_TIMEOUT	10000
+#define FASTOPEN_QLEN	256
+#define ECHO_PENDING	64
+#define BCAST_SLOTS	1024
+#define BCAST_QUEUE	(4 << 20)
+#define HS_MAX		4096
 #define EV_IN(e)	((e) & (POLLIN | POLLHUP))
 #define EV_ERR(e)	((e) & (POLLNVAL | POLLERR))
 
 static int	sigpipe[2];
 static int	signals[NSIG];
-static char	ping_buf[32];
-static int	pong_wait;
+/* A ping is its sequence number, the time it's sent in ns (both big
+ * endian) and random bytes, the last PING_MAX of them are kept. */
+static unsigned char ping_buf[PING_MAX][PING_SIZE];
+static uint64_t	ping_seq;
+/* The oldest ping which isn't answered. */
+static uint64_t	pong_seq;
+static int	ping_ms = PING_TIMEOUT * 1000;
+static int	ping_miss;
+/* Round trip times of the pings in ns. */
+static struct {
+	unsigned long long	n;
+	unsigned long long	missed;
+	unsigned long long	min;
+	unsigned long long	max;
+	unsigned int		b[RTT_BUCKETS];
+} rtt;
+/* A server listens on every resolved address, IPv4 and IPv6. */
+static int	lfds[LISTEN_MAX];
+static int	nlfds;
+/* Handshakes in progress over all WS_EXEC workers, shared memory. */
+static int	*hs_conns;
+static int	hs_max;
+static int	hs_held;
+/* Memory and connections of all WS_EXEC workers, shared memory. */
+static ws_budget *budget;
+static WebSocket *budget_ws;
+
+struct ctrl {
+	int		op;
+	size_t		n;
+	unsigned char	buf[125];
+};
 
 struct loop_ctx {
 	WebSocket	*ws;
@@ -36,6 +110,34 @@ struct loop_ctx {
 	int		sig;
 	const char	*host;
 	const char	*uri;
+	/* Payloads read from the socket, stdout hasn't taken the bytes
+	 * from stageoff yet. The socket isn't read while it's full. */
+	unsigned char	*stage;
+	size_t		stageoff;
+	size_t		stagesz;
+	int		outwait;
+	/* Either direction was held up since the last ping. */
+	int		held;
+	/* stdin waits while the send queue is above the high watermark,
+	 * qretry: the last read didn't fit into the budget. */
+	int		qfull;
+	int		qretry;
+	/* A regular file on stdin till its message is sent. */
+	int		file;
+	off_t		fsize;
+	/* Control frames which wait for the socket, the first one is
+	 * repeated as is on WS_E_WANT_WRITE. */
+	struct ctrl	ctrl[CTRL_PENDING];
+	int		nctrl;
+	/* Our close frame follows the queue (closing), nothing follows it
+	 * (closed) and once it's sent the write side is shut down (shut).
+	 * peer: the peer's close frame is received. */
+	int		closing;
+	int		closed;
+	int		shut;
+	int		peer;
+	uint16_t	ecode;
+	const char	*msg;
 };
 
 static int fd_nonblock(int fd)
@@ -45,6 +147,21 @@ static int fd_nonblock(int fd)
 			 fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0);
 }
 
+static int fd_cloexec(int fd)
+{
+	int flags;
+	return ((flags = fcntl(fd, F_GETFD)) < 0 ||
+			 fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static ssize_t sockrecv(void *opaque, void *buf, size_t n)
 {
 	ssize_t rc;
@@ -72,6 +189,33 @@ static ssize_t socksend(void *opaque, const void *buf, size_t n)
 #endif
 	rc = send(*(int *)opaque, buf, n, 0);
 	if (rc < 0) {
+		/* EINPROGRESS: a Fast Open connect without the cookie. */
+		if (rc < 0 && (SOFT_ERROR || errno == EINPROGRESS))
+			return WS_E_WANT_WRITE;
+		else
+			return WS_E_IO;
+	}
+
+	return rc;
+}
+
+static ssize_t socksendfile(void *opaque, int fd, off_t *off, size_t n)
+{
+	ssize_t rc;
+#if IOFUZZ
+	n = 1 + rand() % n;
+#endif
+#ifdef __linux__
+	rc = sendfile(*(int *)opaque, fd, off, n);
+#else
+	(void)opaque;
+	(void)fd;
+	(void)off;
+	(void)n;
+	rc = -1;
+	errno = ENOSYS;
+#endif
+	if (rc <= 0) {
 		if (rc < 0 && SOFT_ERROR)
 			return WS_E_WANT_WRITE;
 		else
@@ -81,7 +225,32 @@ static ssize_t socksend(void *opaque, const void *buf, size_t n)
 	return rc;
 }
 
-static void wait_event(int fd, int r)
+static int sockcork(void *opaque, int on)
+{
+	return inet_cork(*(int *)opaque, on);
+}
+
+/* Size a fragment by the free room in the socket send buffer, so a control
+ * frame waits at most for one buffer to drain. */
+static size_t sockfrag(void *opaque)
+{
+#ifdef __linux__
+	int fd = *(int *)opaque, outq, sndbuf;
+	socklen_t len = sizeof(sndbuf);
+
+	if (ioctl(fd, TIOCOUTQ, &outq) < 0 ||
+	    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 ||
+	    outq >= sndbuf)
+		return 0;
+
+	return sndbuf - outq;
+#else
+	(void)opaque;
+	return 0;
+#endif
+}
+
+static void wait_event_tmo(int fd, int r, int tmo)
 {
 	struct pollfd fds;
 	int rc;
@@ -90,29 +259,83 @@ static void wait_event(int fd, int r)
 	fds.fd = fd;
 	fds.events = r ? POLLIN : POLLOUT;
 	do {
-		rc = poll(&fds, 1, -1);
+		rc = poll(&fds, 1, tmo);
 	} while (rc < 0 && errno == EINTR);
 }
 
-static ssize_t writeall(int fd, const void *buf, size_t len)
+static void wait_event(int fd, int r)
+{
+	wait_event_tmo(fd, r, -1);
+}
+
+#ifdef HAVE_SPLICE
+/* Socket -> pipe -> fd, the payload doesn't enter user space. What fd
+ * doesn't take stays in the pipe and goes first the next time, only the
+ * bytes which reached fd are reported. */
+static ssize_t socksplice(void *opaque, int fd, size_t n)
 {
-	size_t off = 0, m = len;
-	ssize_t n;
+	static int pp[2] = { -1, -1 };
+	static size_t pend;
+	ssize_t rc = 0, m;
 
-	while (len) {
-		if ((n = write(fd, buf + off, len)) < 0) {
-			if (SOFT_ERROR)
-				wait_event(fd, 0);
+	if (pp[0] == -1 && pipe(pp) < 0)
+		return WS_E_IO;
+#if IOFUZZ
+	n = 1 + rand() % n;
+#endif
+	if (pend < n) {
+		rc = splice(*(int *)opaque, NULL, pp[1], NULL, n - pend,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (rc > 0)
+			pend += rc;
+		else if (pend == 0) {
+			if (rc < 0 && SOFT_ERROR)
+				return WS_E_WANT_READ;
+			else if (!rc)
+				return WS_E_EOF;
 			else
-				return n;
-		} else {
-			off += n;
-			len -= n;
+				return WS_E_IO;
 		}
 	}
 
+	m = splice(pp[0], NULL, fd, NULL, pend < n ? pend : n,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (m < 0)
+		return SOFT_ERROR ? WS_E_WANT_WRITE : WS_E_IO;
+	pend -= m;
+
 	return m;
 }
+#endif
+
+/* Writes the stage as far as stdout takes it, the bytes left. */
+static size_t stage_write(struct loop_ctx *ctx)
+{
+	ssize_t n;
+
+	while (ctx->stageoff < ctx->stagesz) {
+		n = write(ctx->out, ctx->stage + ctx->stageoff,
+			  ctx->stagesz - ctx->stageoff);
+		if (n < 0) {
+			if (!SOFT_ERROR)
+				ERR("write()");
+			ctx->outwait = 1;
+			break;
+		}
+		ctx->stageoff += n;
+	}
+	if (ctx->stageoff == ctx->stagesz)
+		ctx->stageoff = ctx->stagesz = 0;
+
+	return ctx->stagesz - ctx->stageoff;
+}
+
+/* The session is over, nothing else waits for the loop. */
+static void stage_flush(struct loop_ctx *ctx)
+{
+	while (stage_write(ctx) > 0)
+		wait_event(ctx->out, 0);
+}
 
 static void sigall(int signo)
 {
@@ -127,7 +350,7 @@ static void siginit(void)
 	struct sigaction sa;
 	int i;
 	int sigs[] = {
-		SIGALRM, SIGTERM, SIGINT, SIGHUP
+		SIGALRM, SIGTERM, SIGINT, SIGHUP, SIGUSR1
 	};
 
 	if (pipe(sigpipe) < 0)
@@ -154,19 +377,73 @@ static void sigdrain(int fd)
 		;
 }
 
-static void half_close(const struct loop_ctx *ctx)
+/* stdin is done, the close frame goes out after the queue. */
+static void close_after(struct loop_ctx *ctx, uint16_t ecode, const char *msg)
 {
-	const char msg[] = "wscat is gone!";
-	int rc;
-
-	if (ctx->in == -1)
+	ctx->in = -1;
+	ctx->qretry = 0;
+	if (ctx->closing)
 		return;
+	ctx->closing = 1;
+	ctx->ecode = ecode;
+	ctx->msg = msg;
+}
+
+static void half_close(struct loop_ctx *ctx)
+{
+	close_after(ctx, 1001, "wscat is gone!");
+}
+
+/* Control frames keep their order and nothing follows the close frame.
+ * Pings and pongs don't take the last slot, it's the close frame's. */
+static int ctrl_send(struct loop_ctx *ctx, int op, const void *buf, size_t n)
+{
+	struct ctrl *c;
+
+	if (ctx->closed || (op != WS_E_OP_CLOSE &&
+			    ctx->nctrl >= CTRL_PENDING - 1))
+		return -1;
+
+	c = &ctx->ctrl[ctx->nctrl++];
+	c->op = op;
+	c->n = n;
+	if (n > 0)
+		memcpy(c->buf, buf, n);
+	ctx->closed = op == WS_E_OP_CLOSE;
+
+	return 0;
+}
+
+static int ctrl_flush(struct loop_ctx *ctx)
+{
+	struct ctrl *c = ctx->ctrl;
+	int rc = 0;
 
-	while ((rc = ws_close(ctx->ws, 1001, msg, sizeof(msg)-1)))
+	while (ctx->nctrl > 0) {
+		rc = c->op == WS_E_OP_PING ? ws_ping(ctx->ws, c->buf, c->n) :
+		     c->op == WS_E_OP_PONG ? ws_pong(ctx->ws, c->buf, c->n) :
+		     ws_close(ctx->ws, ctx->ecode, c->buf, c->n);
 		if (rc == WS_E_WANT_WRITE)
-			wait_event(ctx->net, 0);
-		else
-			ERRX("ws_close(): failed 0x%X", -rc);
+			break;
+		else if (rc)
+			ERRX("ws_%s(): failed 0x%X", c->op == WS_E_OP_PING ?
+			     "ping" : c->op == WS_E_OP_PONG ? "pong" : "close",
+			     -rc);
+		memmove(c, c + 1, --ctx->nctrl * sizeof(*c));
+	}
+
+	return rc;
+}
+
+static void close_sent(struct loop_ctx *ctx)
+{
+	ctx->shut = 1;
+	if (ctx->peer) {
+		stage_flush(ctx);
+		/* WebSocket session is closed terminate the program. */
+		WARNX("WebSocket session is closed");
+		exit(EXIT_SUCCESS);
+	}
 
 	shutdown(ctx->net, SHUT_WR);
 	/* Reset ping timer and set close timer it will terminate
@@ -177,154 +454,289 @@ static void half_close(const struct loop_ctx *ctx)
 	alarm(CLOSE_TIMEOUT);
 }
 
-static int sig_hnd(const struct loop_ctx *ctx)
+/* A regular file goes as a single binary message. */
+static int file_send(struct loop_ctx *ctx)
 {
-	int i, rc, n = (int)sizeof(ping_buf);
+	ssize_t rc;
 
-	sigdrain(ctx->sig);
+	rc = ws_send_file(ctx->ws, ctx->file, 0, ctx->fsize);
+	if (rc == WS_E_WANT_WRITE)
+		return rc;
+	else if (rc < 0)
+		ERRX("ws_send_file(): failed -0x%zX", -rc);
 
-	if (signals[SIGALRM]) {
-		signals[SIGALRM] = 0;
+	ctx->file = -1;
+	half_close(ctx);
+
+	return 0;
+}
+
+/* Control frames, then the file or the queue and our close frame once
+ * nothing is ahead of it. 1 while the socket has to become writable. */
+static int net_flush(struct loop_ctx *ctx)
+{
+	int rc;
 
-		if (pong_wait)
-			ERRX("PONG is missed");
+	ctrl_flush(ctx);
+	if (ctx->file >= 0)
+		rc = file_send(ctx);
+	else if ((rc = ws_flush(ctx->ws)) == 0)
+		ctx->qfull = 0;
+	else if (rc != WS_E_WANT_WRITE)
+		ERRX("ws_flush(): failed 0x%X", -rc);
+
+	if (rc == 0 && ctx->closing && !ctx->closed)
+		ctrl_send(ctx, WS_E_OP_CLOSE, ctx->msg,
+			  ctx->msg ? strlen(ctx->msg) : 0);
+	if (ctrl_flush(ctx) == WS_E_WANT_WRITE)
+		rc = WS_E_WANT_WRITE;
+	if (ctx->closed && ctx->nctrl == 0 && !ctx->shut)
+		close_sent(ctx);
+
+	return rc == WS_E_WANT_WRITE;
+}
 
-		for (i = 0; i < n; i++)
-			ping_buf[i] = rand() % 256;
+static void ping_arm(void)
+{
+	struct itimerval it;
 
-		while ((rc = ws_ping(ctx->ws, ping_buf, sizeof(ping_buf))))
-			if (rc == WS_E_WANT_WRITE)
-				wait_event(ctx->net, 0);
-			else
-				ERRX("ws_ping(): failed 0x%x", -rc);
-		pong_wait = 1;
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = ping_ms / 1000;
+	it.it_value.tv_usec = ping_ms % 1000 * 1000;
+	setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xFF;
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static int rtt_bucket(unsigned long long v)
+{
+	int e;
+
+	if (v < (1 << RTT_SUB))
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return ((e - RTT_SUB + 1) << RTT_SUB) +
+	       (int)((v >> (e - RTT_SUB)) & ((1 << RTT_SUB) - 1));
+}
+
+/* The middle of bucket i. */
+static unsigned long long rtt_value(int i)
+{
+	int e = (i >> RTT_SUB) + RTT_SUB - 1;
+	unsigned long long m = (i & ((1 << RTT_SUB) - 1)) | (1 << RTT_SUB);
+
+	if (i < (1 << RTT_SUB))
+		return i;
+	return (m << (e - RTT_SUB)) + (1ULL << (e - RTT_SUB)) / 2;
+}
+
+static unsigned long long rtt_pct(int pct)
+{
+	unsigned long long rank = (rtt.n * pct + 99) / 100, c = 0, v;
+	int i;
+
+	for (i = 0; i < RTT_BUCKETS; i++)
+		if ((c += rtt.b[i]) >= rank)
+			break;
+	v = rtt_value(i);
+
+	return v < rtt.min ? rtt.min : v > rtt.max ? rtt.max : v;
+}
+
+static void rtt_print(void)
+{
+	if (rtt.n == 0) {
+		if (rtt.missed > 0)
+			WARNX("rtt: 0 pongs, %llu missed", rtt.missed);
+		return;
+	}
+
+	WARNX("rtt: %llu pongs, %llu missed, min %.1f us, p50 %.1f us, "
+	      "p99 %.1f us, max %.1f us", rtt.n, rtt.missed, rtt.min / 1e3,
+	      rtt_pct(50) / 1e3, rtt_pct(99) / 1e3, rtt.max / 1e3);
+}
+
+/* Once ping_miss pings in a row are unanswered the peer is gone. A pong
+ * behind data the peer doesn't read or behind data stdout doesn't take
+ * is late through no fault of the peer, the tick waits for it then. */
+static void ping_send(struct loop_ctx *ctx)
+{
+	unsigned char *p = ping_buf[ping_seq % PING_MAX];
+	int i, held = ctx->held;
+
+	ctx->held = 0;
+	if (ctx->closed || (held && ping_seq != pong_seq))
+		return;
+
+	if (ping_seq - pong_seq > (uint64_t)ping_miss)
+		ERRX("%llu PONGs are missed",
+		     (unsigned long long)(ping_seq - pong_seq));
+
+	put_be64(p, ping_seq);
+	put_be64(p + 8, now_ns());
+	for (i = 16; i < PING_SIZE; i++)
+		p[i] = rand() % 256;
+
+	if (ctrl_send(ctx, WS_E_OP_PING, p, PING_SIZE) == 0)
+		ping_seq++;
+}
+
+static void pong_hnd(const unsigned char *p, size_t n)
+{
+	unsigned long long t = now_ns();
+	uint64_t seq;
+
+	seq = n == PING_SIZE ? get_be64(p) : ping_seq;
+	/* Only the pings kept are matched, older ones count as missed. */
+	if (seq < pong_seq || seq >= ping_seq || ping_seq - seq > PING_MAX ||
+	    memcmp(ping_buf[seq % PING_MAX], p, n) != 0) {
+		WARNX("PONG doesn't match PING");
+		return;
+	}
+
+	rtt.missed += seq - pong_seq;
+	pong_seq = seq + 1;
+
+	t -= get_be64(p + 8);
+	if (rtt.n++ == 0 || t < rtt.min)
+		rtt.min = t;
+	if (t > rtt.max)
+		rtt.max = t;
+	rtt.b[rtt_bucket(t)]++;
+}
+
+static void sig_hnd(struct loop_ctx *ctx)
+{
+	sigdrain(ctx->sig);
+
+	if (signals[SIGUSR1]) {
+		signals[SIGUSR1] = 0;
+		rtt_print();
+	}
+
+	if (signals[SIGALRM]) {
+		signals[SIGALRM] = 0;
+		ping_send(ctx);
 		/* Restart timer. */
-		alarm(PING_TIMEOUT);
+		ping_arm();
 	} else if (signals[SIGTERM] || signals[SIGINT]) {
 		signals[SIGTERM] = signals[SIGINT] = 0;
 		half_close(ctx);
-		return -1;
 	}
-
-	return 0;
 }
 
-static int coproc_hnd(const struct loop_ctx *ctx,
+static void coproc_hnd(struct loop_ctx *ctx,
 			unsigned char *utf8, size_t *off, size_t n)
 {
 	size_t o = *off;
 	ssize_t m, rc;
 
-	//m = read(ctx->in, utf8 + o, 1);
-	m = read(ctx->in, utf8 + o, n - o);
-	if (m <= 0) {
-		if (m < 0 && SOFT_ERROR) {
-			return 0;
-		} else {
+	/* Bytes the budget had no room for go first. */
+	if (ctx->qretry) {
+		ctx->qretry = 0;
+		m = 0;
+	} else if ((m = read(ctx->in, utf8 + o, n - o)) <= 0) {
+		if (!(m < 0 && SOFT_ERROR))
 			half_close(ctx);
-			return -1;
-		}
+		return;
 	}
 
 	m += o;
 
-	for (;;) {
-		rc = ws_txt_write(ctx->ws, utf8, m);
-		if (rc < 0) {
-			if (rc == WS_E_WANT_WRITE) {
-				wait_event(ctx->net, 0);
-			} else if (rc == WS_E_UTF8_INCOPMLETE) {
-				assert(m < 4);
-				o = m;
-				break;
-			} else if (rc == WS_E_NON_UTF8) {
-				o = 0;
-				break;
-			} else {
-				ERRX("ws_txt_write(): failed -0x%zX", -rc);
-			}
-		} else {
-			o = m - rc;
-			/* Partial UTF-8. */
-			if (o > 0) {
-				assert(o < 4);
-				memmove(utf8, utf8 + rc, o);
-			}
-			break;
+	rc = ws_queue(ctx->ws, 1, utf8, m);
+	if (rc == WS_E_UTF8_INCOPMLETE) {
+		assert(m < 4);
+		o = m;
+	} else if (rc == WS_E_NON_UTF8) {
+		o = 0;
+	} else if (rc == WS_E_BUDGET && ws_queued(ctx->ws) > 0 &&
+		   !ws_budget_shed(ctx->ws)) {
+		/* Other connections hold the budget, try again once our
+		 * queue is out. */
+		ctx->qfull = ctx->qretry = 1;
+		o = m;
+	} else if (rc < 0) {
+		ERRX("ws_queue(): failed -0x%zX", -rc);
+	} else {
+		o = m - rc;
+		/* Partial UTF-8. */
+		if (o > 0) {
+			assert(o < 4);
+			memmove(utf8, utf8 + rc, o);
 		}
 	}
 
 	*off = o;
-	return 0;
 }
 
-static void ws_ctrl(const struct loop_ctx *ctx, int e)
+static void ws_ctrl(struct loop_ctx *ctx, int e)
 {
-	int rc;
-
 	if (e == WS_E_OP_CLOSE) {
-		/* WebSocket is already half_closed (can't write). */
-		if (ctx->in == -1) {
+		ctx->peer = 1;
+		/* Our close frame is already sent, the session is over. */
+		if (ctx->shut) {
+			stage_flush(ctx);
 			WARNX("WebSocket session is closed");
 			exit(EXIT_SUCCESS);
 		}
-		/* Confirm close with received ecode. */
-		while ((rc = ws_close(ctx->ws, ctx->ws->ecode, NULL, 0)))
-			if (rc == WS_E_WANT_WRITE)
-				wait_event(ctx->net, 0);
-			else
-				ERRX("ws_close(): failed 0x%X", -rc);
-		/* WebSocket session is closed terminate the program. */
-		WARNX("WebSocket session is closed");
-		exit(EXIT_SUCCESS);
+		/* Confirm close with received ecode after the queue. */
+		close_after(ctx, ctx->ws->ecode, NULL);
 	} else if (e == WS_E_OP_PING) {
-		/* WebSocket is already half_closed (can't write). */
-		if (ctx->in == -1)
-			return;
 		/* Pong with Ping data. */
-		while ((rc = ws_pong(ctx->ws, ctx->ws->ctrl, ctx->ws->ctrlsz)))
-			if (rc == WS_E_WANT_WRITE)
-				wait_event(ctx->net, 0);
-			else
-				ERRX("ws_pong(): failed 0x%X", -rc);
+		ctrl_send(ctx, WS_E_OP_PONG, ctx->ws->ctrl, ctx->ws->ctrlsz);
 	} else if (e == WS_E_OP_PONG) {
-		if (!pong_wait)
-			return;
-		pong_wait = 0;
-		if (ctx->ws->ctrlsz != sizeof(ping_buf) ||
-		    memcmp(ping_buf, ctx->ws->ctrl, ctx->ws->ctrlsz) != 0)
-			WARNX("PONG doesn't match PING");
+		/* Unsolicited pongs are allowed. */
+		if (ping_seq != pong_seq)
+			pong_hnd(ctx->ws->ctrl, ctx->ws->ctrlsz);
 	}
 }
 
-static void
-drain(void *opaque, const void *buf, size_t n, int txt)
+/* Binary payload bypasses the stage, keep the order. */
+static int sink(void *opaque, size_t n)
 {
 	struct loop_ctx *ctx = opaque;
 
-	if (!txt)
-		ERRX("ws_parse(): non text data");
-	if (writeall(ctx->out, buf, n) < 0)
-		ERR("writeall()");
+	(void)n;
+	return stage_write(ctx) == 0 ? ctx->out : -1;
 }
 
-static void ws_hnd(const struct loop_ctx *ctx)
+/* Payloads go right to the stage and the reading stops when stdout
+ * doesn't take a full one, the rest waits in the socket. */
+static void ws_hnd(struct loop_ctx *ctx)
 {
-	unsigned char buf[256];
 	ssize_t rc;
 	int txt;
 
-	for (;;) {
-		/* Use both read and parse API. */
-		rc = (rand() % 256 > 128) ?
-			ws_read(ctx->ws, buf, sizeof(buf), &txt) :
-			ws_parse(ctx->ws, (void *)ctx, drain);
+	while (!ctx->outwait && !ctx->peer) {
+		if (ctx->stagesz == STAGE_SIZE && stage_write(ctx) > 0)
+			break;
+		rc = ws_read(ctx->ws, ctx->stage + ctx->stagesz,
+			     STAGE_SIZE - ctx->stagesz, &txt);
 		if (rc <= 0) {
 			if (!rc)
 				rc = WS_E_EOF;
 
 			if (rc == WS_E_WANT_READ)
 				break;
+			else if (rc == WS_E_WANT_WRITE)
+				/* The sink is full. */
+				ctx->outwait = 1;
 			else if (rc == WS_E_OP_CLOSE ||
 				 rc == WS_E_OP_PING  ||
 				 rc == WS_E_OP_PONG)
@@ -332,135 +744,1700 @@ static void ws_hnd(const struct loop_ctx *ctx)
 			else
 				ERRX("ws_read(): failed 0x%zX", -rc);
 		} else {
-			drain((void *)ctx, buf, rc, txt);
+			ctx->stagesz += rc;
 		}
 	}
+	/* The socket is drained, emit everything staged. */
+	stage_write(ctx);
+}
+
+static void q_wm(void *opaque, int above)
+{
+	struct loop_ctx *ctx = opaque;
+
+	ctx->qfull = above;
+}
+
+/* Workers usually leave with exit(), give the budget back anyway. */
+static void budget_release(void)
+{
+	if (budget_ws)
+		ws_set_budget(budget_ws, NULL);
+}
+
+static void hs_release(void)
+{
+	if (hs_held) {
+		__atomic_sub_fetch(hs_conns, 1, __ATOMIC_RELAXED);
+		hs_held = 0;
+	}
+}
+
+/* The answer to a bad or late client is best-effort, it must not make
+ * the server wait again. */
+static void hs_reject(WebSocket *ws, int fd, int busy)
+{
+	int i, rc;
+
+	for (i = 0; i < 3 && (rc = ws_reject(ws, busy)); i++)
+		if (rc == WS_E_WANT_WRITE)
+			wait_event_tmo(fd, 0, 100);
+		else
+			break;
 }
 
 static void wscat(struct loop_ctx *ctx)
 {
-	struct pollfd fds[3];
+	struct stat st;
+	struct pollfd fds[4];
 	unsigned char utf8[16536];
 	char uhdrs[128];
 	size_t off = 0;
 	ssize_t rc;
+	int wr;
 
 	/* Set some extra HTTP headers. */
 	snprintf(uhdrs, sizeof(uhdrs),  "Header1: Value1\r\n"
 					"Header2: Value2\r\n");
 	while ((rc = ws_handshake(ctx->ws, ctx->host, ctx->uri, uhdrs)))
 		if (rc == WS_E_WANT_READ || rc == WS_E_WANT_WRITE)
-			wait_event(ctx->net, rc == WS_E_WANT_READ);
-		else
+			wait_event_tmo(ctx->net, rc == WS_E_WANT_READ,
+					ws_handshake_timeout(ctx->ws));
+		else {
+			if (ctx->ws->srv && (rc == WS_E_TIMEOUT ||
+					     rc == WS_E_HTTP_HDR_LIMIT))
+				hs_reject(ctx->ws, ctx->net, 0);
 			ERRX("ws_handshake(): failed -0x%zX", -rc);
+		}
+	hs_release();
 
-	poll(NULL, 0, 100);
 	fds[0].fd = ctx->sig;
 	fds[0].events = POLLIN;
-	fds[1].fd = ctx->in;
 	fds[1].events = POLLIN;
-	fds[2].fd = ctx->net;
-	fds[2].events = POLLIN;
-	alarm(PING_TIMEOUT);
+	fds[3].events = POLLOUT;
+	if (ping_ms > 0)
+		ping_arm();
+	atexit(rtt_print);
+
+	if (fstat(ctx->in, &st) == 0 && S_ISREG(st.st_mode)) {
+		ctx->file = ctx->in;
+		ctx->fsize = st.st_size;
+		ctx->in = -1;
+	}
 
+	/* Nothing here blocks: stdin stops while the queue is full, the
+	 * socket isn't read while stdout is and the control frames go out
+	 * between messages either way. */
 	for (;;) {
-		rc = poll(fds, 3, -1);
+		if (ctx->qretry && !ctx->qfull)
+			coproc_hnd(ctx, utf8, &off, sizeof(utf8));
+		wr = net_flush(ctx);
+		if (wr || ctx->outwait)
+			ctx->held = 1;
+
+		fds[1].fd = ctx->qfull ? -1 : ctx->in;
+		fds[2].events = (ctx->outwait || ctx->peer ? 0 : POLLIN) |
+				(wr ? POLLOUT : 0);
+		fds[2].fd = fds[2].events ? ctx->net : -1;
+		fds[3].fd = ctx->outwait ? ctx->out : -1;
+
+		rc = poll(fds, 4, -1);
 		if (rc < 0 && errno == EINTR)
 			continue;
 		else if (rc < 0)
 			ERR("poll()");
 
-		if (EV_IN(fds[0].revents)) {
-			if (sig_hnd(ctx) < 0) {
-				ctx->in = fds[1].fd = -1;
-				fds[1].revents = 0;
-			}
-		}
+		if (EV_IN(fds[0].revents))
+			sig_hnd(ctx);
 
-		/* fd -> ws */
-		if (EV_ERR(fds[1].revents)) {
+		/* fd -> ws, unless a signal closed it. */
+		if (ctx->in >= 0 && EV_ERR(fds[1].revents))
 			half_close(ctx);
-			ctx->in = fds[1].fd = -1;
-		} else if (EV_IN(fds[1].revents)) {
-			if (coproc_hnd(ctx, utf8, &off, sizeof(utf8)) < 0)
-				ctx->in = fds[1].fd = -1;
-		}
+		else if (ctx->in >= 0 && EV_IN(fds[1].revents))
+			coproc_hnd(ctx, utf8, &off, sizeof(utf8));
 
 		/* ws -> fd */
-		if (EV_ERR(fds[2].revents))
+		if (EV_ERR(fds[2].revents)) {
+			stage_flush(ctx);
 			return;
-		else if (EV_IN(fds[2].revents))
+		}
+		if (fds[3].revents) {
+			ctx->outwait = 0;
+			stage_write(ctx);
+		}
+		/* The input buffer may hold more than the socket. */
+		if (fds[3].revents || EV_IN(fds[2].revents))
 			ws_hnd(ctx);
 	}
 }
 
-static void wscat_run(WebSocket *ws, int fd, const char *host, const char *uri)
+#ifdef WS_TLS
+/* A server with WS_CERT or a client with WS_TLS talks TLS. */
+static void tls_run(WebSocket *ws, int fd, const char *host)
 {
-	struct loop_ctx ctx;
+	static SSL_CTX *ctx;
+	static struct tls_bio tls;
+	const char *cert = getenv("WS_CERT"), *key = getenv("WS_KEY");
+	char name[1024], *p;
+	long long end, left;
+	int rc, tmo;
+
+	if (ws->srv ? !cert : !getenv("WS_TLS"))
+		return;
 
-	ws_set_bio(ws, &fd, socksend, sockrecv);
-	siginit();
-	ctx.ws   = ws;
-	ctx.in   = STDIN_FILENO;
-	ctx.out  = STDOUT_FILENO;
-	ctx.net  = fd;
-	ctx.sig  = sigpipe[0];
-	ctx.host = host;
-	ctx.uri  = uri;
-	wscat(&ctx);
+	if (!ctx && (ctx = tls_bio_ctx(ws->srv, cert, key ? key : cert,
+			getenv("WS_CA"), getenv("WS_KTLS") != NULL)) == NULL)
+		ERRX("tls_bio_ctx() failed");
+
+	/* host is dest[:port] or [v6][:port]. */
+	snprintf(name, sizeof(name), "%s", host + (host[0] == '['));
+	if ((p = strrchr(name, host[0] == '[' ? ']' : ':')) != NULL)
+		*p = 0;
+
+	if (tls_bio_init(&tls, ctx, fd, ws->srv ? NULL : name) < 0)
+		ERRX("tls_bio_init() failed");
+
+	/* WS_HS_TIMEOUT covers the TLS handshake too, a 400 in clear text
+	 * means nothing to a TLS peer so a late one is just dropped. */
+	tmo = ws_handshake_timeout(ws);
+	end = now_ns() + tmo * 1000000LL;
+	while ((rc = tls_bio_handshake(&tls)))
+		if (rc == WS_E_WANT_READ || rc == WS_E_WANT_WRITE) {
+			left = tmo < 0 ? -1 : (end - now_ns()) / 1000000;
+			if (tmo >= 0 && left <= 0)
+				ERRX("tls_bio_handshake(): failed -0x%X",
+				     -WS_E_TIMEOUT);
+			wait_event_tmo(fd, rc == WS_E_WANT_READ, (int)left);
+		} else
+			ERRX("tls_bio_handshake(): failed -0x%X", -rc);
+
+	if (getenv("WS_KTLS"))
+		WARNX("kTLS tx %s, rx %s", tls.ktls_tx ? "on" : "off",
+					   tls.ktls_rx ? "on" : "off");
+
+	ws_set_bio(ws, &tls, tls_bio_send, tls_bio_recv);
+	ws_set_bio_cork(ws, NULL);
+	/* Without kTLS the payload must pass through OpenSSL. */
+	ws_set_bio_sendfile(ws, tls.ktls_tx ? tls_bio_sendfile : NULL);
+#ifdef HAVE_SPLICE
+	ws_set_bio_splice(ws, tls.ktls_rx ? socksplice : NULL);
+#endif
 }
+#endif
 
-static void srv(const char *addr, const char *port,
-		const char *host, const char *uri)
+/* Handshake limits and buffer sizes from the environment. */
+static void ws_limits(WebSocket *ws)
 {
-	struct sockaddr_storage ss;
-	socklen_t slen;
-	WebSocket ws;
-	int fd, afd;
+	const char *tmo = getenv("WS_HS_TIMEOUT"), *max = getenv("WS_HS_MAX");
+	const char *bmin = getenv("WS_BUF_MIN"), *bmax = getenv("WS_BUF_MAX");
+
+	ws_set_handshake_limit(ws, max ? atoi(max) : HS_MAX,
+				   tmo ? atoi(tmo) : HS_TIMEOUT);
+	if ((bmin || bmax) &&
+	    ws_set_buf_size(ws, bmin ? strtoul(bmin, NULL, 0) : WS_BUF_MIN,
+			    bmax ? strtoul(bmax, NULL, 0) : WS_BUF_SIZE) < 0)
+		ERRX("WS_BUF_MIN must not be greater than WS_BUF_MAX");
+}
 
-	if ((fd = tcp_listen(addr, port)) < 0)
-		ERR("tcp_listen() failed");
+/* WS_RECORD taps the bio, the bytes of each direction after the HTTP
+ * header go through a parser of their own. */
+static struct {
+	ssize_t		(*recv)(void *ctx, void *buf, size_t n);
+	ssize_t		(*send)(void *ctx, const void *buf, size_t n);
+	ws_cap		*cap;
+	WebSocket	ws[2];
+	/* Bytes of the header's "\r\n\r\n" seen. */
+	int		hdr[2];
+	const unsigned char *p;
+	size_t		n;
+} rec;
+
+static ssize_t rec_feed(void *ctx, void *buf, size_t n)
+{
+	(void)ctx;
+	if (rec.n == 0)
+		return WS_E_WANT_READ;
+	if (n > rec.n)
+		n = rec.n;
+	memcpy(buf, rec.p, n);
+	rec.p += n;
+	rec.n -= n;
+
+	return n;
+}
 
-	for (;;) {
-		slen = sizeof(ss);
-		afd = accept(fd, (struct sockaddr *)&ss, &slen);
-		if (afd < 0) {
-			if (!SOFT_ERROR)
-				WARN("accept()");
-			continue;
-		}
+static void rec_end(void)
+{
+	if (rec.cap && ws_cap_close(rec.cap) < 0)
+		WARNX("WS_RECORD: the capture is incomplete");
+	rec.cap = NULL;
+}
 
-		if (fd_nonblock(afd) < 0)
-			ERR("fd_nonblock() failed");
+static void rec_tap(int dir, const unsigned char *p, size_t n)
+{
+	ws_frame f;
+	int rc;
 
-		if (ws_init(&ws, 1) < 0)
-			ERRX("ws_init() failed");
+	for (; n > 0 && rec.hdr[dir] < 4; p++, n--)
+		rec.hdr[dir] = *p == "\r\n\r\n"[rec.hdr[dir]] ?
+			       rec.hdr[dir] + 1 : *p == '\r';
 
-		close(fd);
-		wscat_run(&ws, afd, host, uri);
+	rec.p = p;
+	rec.n = n;
+	while (rec.cap && (rc = ws_read_frame(&rec.ws[dir], &f)) == 0)
+		if (ws_cap_frame(rec.cap, 0, dir, &f) < 0)
+			rec_end();
 
-		ws_deinit(&ws);
-		close(afd);
-		break;
+	if (rec.cap && rc != WS_E_WANT_READ) {
+		WARNX("WS_RECORD: bad frame -0x%X", -rc);
+		rec_end();
 	}
 }
 
-static void usr(const char *addr, const char *port,
-		const char *host, const char *uri)
+static ssize_t rec_recv(void *ctx, void *buf, size_t n)
 {
-	WebSocket ws;
-	int fd;
-
-	if ((fd = tcp_connect(addr, port, 0)) < 0)
-		ERR("tcp_connect() failed");
+	ssize_t rc = rec.recv(ctx, buf, n);
 
-	if (fd_nonblock(fd) < 0)
-		ERR("fd_nonblock() failed");
+	if (rc > 0)
+		rec_tap(WS_CAP_IN, buf, rc);
+	return rc;
+}
 
-	if (ws_init(&ws, 0) < 0)
-		ERRX("ws_init() failed");
+static ssize_t rec_send(void *ctx, const void *buf, size_t n)
+{
+	ssize_t rc = rec.send(ctx, buf, n);
 
-	wscat_run(&ws, fd, host, uri);
+	if (rc > 0)
+		rec_tap(WS_CAP_OUT, buf, rc);
+	return rc;
+}
+
+/* Every payload has to pass the tap, sendfile(2) and splice(2) are off. */
+static void rec_start(WebSocket *ws, const char *path)
+{
+	char name[1024];
+
+	/* Every WS_EXEC connection has its own file. */
+	if (getenv("WS_EXEC"))
+		snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+	else
+		snprintf(name, sizeof(name), "%s", path);
+
+	if ((rec.cap = ws_cap_open(name, ws->srv)) == NULL)
+		ERR("WS_RECORD: %s", name);
+	/* The parser of what comes in has the role of this side. */
+	if (ws_init(&rec.ws[WS_CAP_IN], ws->srv) < 0 ||
+	    ws_init(&rec.ws[WS_CAP_OUT], !ws->srv) < 0)
+		ERRX("ws_init() failed");
+	ws_set_bio(&rec.ws[WS_CAP_IN], NULL, NULL, rec_feed);
+	ws_set_bio(&rec.ws[WS_CAP_OUT], NULL, NULL, rec_feed);
+	atexit(rec_end);
+
+	rec.recv = ws->recv;
+	rec.send = ws->send;
+	ws_set_bio(ws, ws->ctx, rec_send, rec_recv);
+	ws_set_bio_sendfile(ws, NULL);
+#ifdef HAVE_SPLICE
+	ws_set_bio_splice(ws, NULL);
+#endif
+}
+
+static void wscat_run(WebSocket *ws, int fd, int in, int out,
+			const char *host, const char *uri)
+{
+	const char *recpath = getenv("WS_RECORD");
+	static unsigned char stage[STAGE_SIZE];
+	const char *frag = getenv("WS_FRAG");
+	const char *ping = getenv("WS_PING"), *miss = getenv("WS_PING_MISS");
+	struct loop_ctx ctx;
+
+	if (ping)
+		ping_ms = atoi(ping);
+	if (miss)
+		ping_miss = atoi(miss);
+
+	ws_set_bio(ws, &fd, socksend, sockrecv);
+	ws_set_bio_sendfile(ws, socksendfile);
+	ws_set_bio_cork(ws, sockcork);
+#ifdef HAVE_SPLICE
+	ws_set_bio_splice(ws, socksplice);
+#endif
+	if (frag)
+		ws_set_frag(ws, atoi(frag),
+			    strcmp(frag, "auto") == 0 ? sockfrag : NULL);
+	ws_limits(ws);
+	siginit();
+#ifdef WS_TLS
+	tls_run(ws, fd, host);
+#endif
+	if (recpath)
+		rec_start(ws, recpath);
+	if (fd_nonblock(out) < 0)
+		ERR("fd_nonblock() failed");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.ws   = ws;
+	ctx.in   = in;
+	ctx.out  = out;
+	ctx.net  = fd;
+	ctx.sig  = sigpipe[0];
+	ctx.host = host;
+	ctx.uri  = uri;
+	ctx.stage = stage;
+	ctx.file  = -1;
+	ws_set_queue_watermarks(ws, QUEUE_LOW, QUEUE_HIGH, &ctx, q_wm);
+	if (getenv("WS_SPLICE"))
+		ws_set_sink(ws, &ctx, sink);
+	wscat(&ctx);
+}
+
+/* Socket options for every connection from the environment. */
+static void sock_tune(void)
+{
+	const char *prof = getenv("WS_TUNE"), *ka = getenv("WS_KEEPALIVE");
+	const char *uto = getenv("WS_USER_TIMEOUT");
+	const char *tfo = getenv("WS_FASTOPEN"), *tmo = getenv("WS_HS_TIMEOUT");
+	struct inet_tune t;
+
+	memset(&t, 0, sizeof(t));
+	if (prof && inet_tune_profile(&t, prof) < 0)
+		ERRX("WS_TUNE must be latency or throughput");
+	t.keepalive = ka ? atoi(ka) : 0;
+	t.user_timeout = uto ? atoi(uto) : 0;
+	t.fastopen = tfo ? (atoi(tfo) > 0 ? atoi(tfo) : FASTOPEN_QLEN) : 0;
+	/* Clients speak first, the listeners wake up with the request,
+	 * a silent one is dropped after the handshake timeout (if any). */
+	t.defer_accept = !tmo ? HS_TIMEOUT / 1000 :
+			 atoi(tmo) > 0 ? (atoi(tmo) + 999) / 1000 : 0;
+	inet_set_tune(&t);
+}
+
+/* A non-blocking close-on-exec connection from lfd, tuned. */
+static int accept_nb(int lfd)
+{
+	int afd;
+
+#ifdef __linux__
+	if ((afd = accept4(lfd, NULL, NULL,
+			   SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return -1;
+#else
+	if ((afd = accept(lfd, NULL, NULL)) < 0)
+		return -1;
+	if (fd_nonblock(afd) < 0 || fd_cloexec(afd) < 0) {
+		close(afd);
+		return -1;
+	}
+#endif
+	inet_tune(afd, NULL);
+
+	return afd;
+}
+
+static void listen_all(const char *addr, const char *port)
+{
+	const char *ux = getenv("WS_UNIX");
+	char path[1024];
+	int i;
+
+	nlfds = inet_listen_all("tcp", addr, port, lfds, LISTEN_MAX - !!ux);
+	if (nlfds < 0)
+		ERR("inet_listen_all() failed");
+
+	/* Same host peers may come through a Unix socket too. */
+	if (ux) {
+		snprintf(path, sizeof(path), "unix:%s", ux);
+		if ((lfds[nlfds++] = inet_listen("tcp", path, NULL)) < 0)
+			ERR("inet_listen(%s) failed", path);
+	}
+
+	/* Listeners must neither leak into commands nor block a worker
+	 * which lost a connection to another one. */
+	for (i = 0; i < nlfds; i++)
+		if (fd_nonblock(lfds[i]) < 0 || fd_cloexec(lfds[i]) < 0)
+			ERR("listener setup failed");
+}
+
+static void listen_close(void)
+{
+	while (nlfds > 0)
+		close(lfds[--nlfds]);
+}
+
+/* Wait for a connection on any listener. */
+static int accept_any(void)
+{
+	struct pollfd fds[LISTEN_MAX];
+	int i, afd;
+
+	for (;;) {
+		for (i = 0; i < nlfds; i++) {
+			fds[i].fd = lfds[i];
+			fds[i].events = POLLIN;
+		}
+		if (poll(fds, nlfds, -1) < 0) {
+			if (errno != EINTR)
+				ERR("poll()");
+			continue;
+		}
+
+		for (i = 0; i < nlfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			if ((afd = accept_nb(lfds[i])) >= 0)
+				return afd;
+			if (!SOFT_ERROR)
+				WARN("accept()");
+		}
+	}
+}
+
+static void srv(const char *addr, const char *port,
+		const char *host, const char *uri)
+{
+	WebSocket ws;
+	int afd;
+
+	listen_all(addr, port);
+	afd = accept_any();
+	listen_close();
+
+	if (ws_init(&ws, 1) < 0)
+		ERRX("ws_init() failed");
+
+	wscat_run(&ws, afd, STDIN_FILENO, STDOUT_FILENO, host, uri);
+
+	ws_deinit(&ws);
+	close(afd);
+}
+
+/* Start sh -c cmd, in reads its stdout and out writes its stdin. */
+static pid_t coproc(const char *cmd, int *in, int *out)
+{
+	int i[2], o[2];
+	pid_t pid;
+
+	if (pipe(i) < 0)
+		return -1;
+	if (pipe(o) < 0) {
+		close(i[0]);
+		close(i[1]);
+		return -1;
+	}
+
+	if ((pid = fork()) < 0) {
+		close(i[0]);
+		close(i[1]);
+		close(o[0]);
+		close(o[1]);
+		return -1;
+	} else if (pid == 0) {
+		if (dup2(o[0], STDIN_FILENO) < 0 ||
+		    dup2(i[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		close(i[0]);
+		close(i[1]);
+		close(o[0]);
+		close(o[1]);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	close(o[0]);
+	close(i[1]);
+	*in  = i[0];
+	*out = o[1];
+	return pid;
+}
+
+/* A pool worker starts the command first and only then waits for a
+ * connection, so the connection doesn't pay fork() + exec() latency. */
+static void worker(int notify, const char *cmd,
+			const char *host, const char *uri)
+{
+	WebSocket ws;
+	int afd, in, out;
+	char a = 'a';
+
+	signal(SIGCHLD, SIG_DFL);
+
+	if (coproc(cmd, &in, &out) < 0)
+		ERR("coproc() failed");
+
+	if (fd_nonblock(in) < 0 || fd_nonblock(out) < 0)
+		ERR("fd_nonblock() failed");
+
+	afd = accept_any();
+
+	/* Ask the master for a replacement. */
+	if (write(notify, &a, 1) < 0)
+		WARN("write()");
+	close(notify);
+	listen_close();
+
+	/* Refuse before allocating when the budget is exhausted or there
+	 * are too many handshakes in flight. */
+	if (budget && ws_budget_admit(budget) < 0) {
+		memset(&ws, 0, sizeof(ws));
+		ws_set_bio(&ws, &afd, socksend, sockrecv);
+		hs_reject(&ws, afd, 1);
+		close(afd);
+		exit(EXIT_FAILURE);
+	}
+
+	if (hs_conns) {
+		if (__atomic_add_fetch(hs_conns, 1, __ATOMIC_RELAXED) > hs_max) {
+			__atomic_sub_fetch(hs_conns, 1, __ATOMIC_RELAXED);
+			memset(&ws, 0, sizeof(ws));
+			ws_set_bio(&ws, &afd, socksend, sockrecv);
+			hs_reject(&ws, afd, 1);
+			close(afd);
+			exit(EXIT_FAILURE);
+		}
+		hs_held = 1;
+		atexit(hs_release);
+	}
+
+	if (ws_init(&ws, 1) < 0)
+		ERRX("ws_init() failed");
+	if (budget) {
+		ws_set_budget(&ws, budget);
+		budget_ws = &ws;
+		atexit(budget_release);
+	}
+
+	wscat_run(&ws, afd, in, out, host, uri);
+
+	budget_ws = NULL;
+	ws_deinit(&ws);
+	close(afd);
+	exit(EXIT_SUCCESS);
+}
+
+static void spawn(int notify, const char *cmd,
+			const char *host, const char *uri)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		WARN("fork()");
+	else if (pid == 0)
+		worker(notify, cmd, host, uri);
+}
+
+static void srv_exec(const char *addr, const char *port,
+			const char *host, const char *uri)
+{
+	const char *cmd = getenv("WS_EXEC"), *pool = getenv("WS_POOL");
+	const char *conns = getenv("WS_HS_CONNS");
+	const char *mem = getenv("WS_MEM"), *maxc = getenv("WS_CONNS");
+	unsigned char buf[64];
+	int notify[2], n, i;
+	ssize_t rc;
+
+	n = pool ? atoi(pool) : POOL_SIZE;
+	if (n <= 0)
+		ERRX("WS_POOL must be positive");
+
+	if (conns && (hs_max = atoi(conns)) > 0) {
+		hs_conns = mmap(NULL, sizeof(*hs_conns), PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (hs_conns == MAP_FAILED)
+			ERR("mmap()");
+		*hs_conns = 0;
+	}
+
+	if (mem || maxc) {
+		budget = mmap(NULL, sizeof(*budget), PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (budget == MAP_FAILED)
+			ERR("mmap()");
+		ws_budget_init(budget, mem ? strtoul(mem, NULL, 0) : 0,
+					maxc ? atoi(maxc) : 0);
+	}
+
+	listen_all(addr, port);
+
+	if (pipe(notify) < 0)
+		ERR("pipe()");
+	/* The pipe must not leak into commands. */
+	if (fd_cloexec(notify[0]) < 0 || fd_cloexec(notify[1]) < 0)
+		ERR("fd_cloexec() failed");
+
+	/* Workers are reaped automatically. */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (i = 0; i < n; i++)
+		spawn(notify[1], cmd, host, uri);
+
+	for (;;) {
+		rc = read(notify[0], buf, sizeof(buf));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc <= 0)
+			ERR("read()");
+		/* Every byte is an accepted connection, refill the pool. */
+		while (rc-- > 0)
+			spawn(notify[1], cmd, host, uri);
+	}
+}
+
+/* A client and its upstream connection, side 0 is the client (the relay
+ * is its server), side 1 is the upstream server. f[i] is a frame read
+ * from side i which waits to be written to the other side. */
+struct relay {
+	WebSocket	ws[2];
+	int		fd[2];
+	short		ev[2];
+	unsigned char	hs[2];
+	unsigned char	pend[2];
+	unsigned char	closed[2];
+	ws_frame	f[2];
+	unsigned long long bytes[2];
+	struct timespec	start;
+	/* Connecting upstream while fd[1] < 0. */
+	struct inet_race race;
+	/* Its pollfds. */
+	size_t		pi;
+	size_t		pn;
+};
+
+static void relay_free(struct relay *r, int rc)
+{
+	struct timespec now;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = (now.tv_sec - r->start.tv_sec) +
+	    (now.tv_nsec - r->start.tv_nsec) / 1e9;
+	WARNX("relay %d: %s -0x%X, up %llu B, down %llu B, %.3f s, %.2f MB/s",
+		r->fd[0], rc > 0 || rc == WS_E_EOF ? "closed" : "failed",
+		rc > 0 ? 0 : -rc,
+		r->bytes[0], r->bytes[1], t,
+		t > 0 ? (r->bytes[0] + r->bytes[1]) / t / 1e6 : 0.0);
+
+	ws_deinit(&r->ws[0]);
+	ws_deinit(&r->ws[1]);
+	close(r->fd[0]);
+	if (r->fd[1] >= 0)
+		close(r->fd[1]);
+	inet_race_end(&r->race);
+	free(r);
+}
+
+static struct relay *relay_new(int afd, const char *uaddr, const char *uport)
+{
+	struct relay *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) {
+		close(afd);
+		return NULL;
+	}
+
+	r->fd[0] = afd;
+	r->fd[1] = -1;
+	if (ws_init(&r->ws[0], 1) < 0) {
+		close(afd);
+		free(r);
+		return NULL;
+	}
+	if (ws_init(&r->ws[1], 0) < 0 ||
+	    inet_race_start(&r->race, "tcp", uaddr, uport) < 0) {
+		WARN("relay upstream");
+		ws_set_bio(&r->ws[0], &r->fd[0], socksend, sockrecv);
+		ws_reject(&r->ws[0], 1);
+		ws_deinit(&r->ws[0]);
+		ws_deinit(&r->ws[1]);
+		close(afd);
+		free(r);
+		return NULL;
+	}
+
+	ws_set_bio(&r->ws[0], &r->fd[0], socksend, sockrecv);
+	ws_set_bio(&r->ws[1], &r->fd[1], socksend, sockrecv);
+	ws_limits(&r->ws[0]);
+	ws_limits(&r->ws[1]);
+	/* The client's payload is unmasked and remasked in one pass. */
+	ws_set_frame_raw(&r->ws[0], 1);
+	clock_gettime(CLOCK_MONOTONIC, &r->start);
+
+	return r;
+}
+
+/* 0 while the pair is alive, 1 when both sides have closed or < 0. */
+static int relay_io(struct relay *r, const char *host, const char *uhost,
+			const char *uri)
+{
+	int i, rc;
+
+	/* The upstream connect races over its addresses. */
+	if (r->fd[1] < 0) {
+		r->fd[1] = inet_race_step(&r->race);
+		if (r->fd[1] < 0 && errno != EINPROGRESS) {
+			if (!r->hs[0])
+				ws_reject(&r->ws[0], 1);
+			return WS_E_IO;
+		}
+		if (r->fd[1] >= 0)
+			inet_race_end(&r->race);
+	}
+
+	r->ev[0] = r->ev[1] = 0;
+	for (i = 0; i < 2; i++) {
+		if (r->hs[i] || r->fd[i] < 0)
+			continue;
+		rc = ws_handshake(&r->ws[i], i ? uhost : host, uri, NULL);
+		if (rc == WS_E_WANT_READ || rc == WS_E_WANT_WRITE) {
+			r->ev[i] |= rc == WS_E_WANT_READ ? POLLIN : POLLOUT;
+			continue;
+		}
+		if (rc) {
+			if (!r->hs[0])
+				ws_reject(&r->ws[0], i == 1);
+			return rc;
+		}
+		r->hs[i] = 1;
+	}
+	if (!r->hs[0] || !r->hs[1])
+		return 0;
+
+	/* Frames go through as they arrive, messages aren't reassembled. */
+	for (i = 0; i < 2; i++) {
+		for (;;) {
+			if (!r->pend[i]) {
+				rc = ws_read_frame(&r->ws[i], &r->f[i]);
+				if (rc == WS_E_WANT_READ) {
+					r->ev[i] |= POLLIN;
+					break;
+				} else if (rc)
+					return rc;
+				r->pend[i] = 1;
+			}
+
+			rc = ws_write_frame(&r->ws[!i], &r->f[i]);
+			if (rc == WS_E_WANT_WRITE) {
+				r->ev[!i] |= POLLOUT;
+				break;
+			} else if (rc)
+				return rc;
+
+			r->pend[i] = 0;
+			r->bytes[i] += r->f[i].n;
+			if (r->f[i].op == WS_OP_CLOSE)
+				r->closed[i] = 1;
+		}
+	}
+
+	return r->closed[0] && r->closed[1];
+}
+
+/* Many client/upstream pairs on one poll() loop. */
+static void relay(const char *addr, const char *port,
+			const char *host, const char *uri)
+{
+	const char *up = getenv("WS_RELAY");
+	char uaddr[1024], uhost[1024 + 8], *uport;
+	struct relay **rs = NULL, *r;
+	struct pollfd *fds = NULL;
+	size_t n = 0, cap = 0, k, i, j, m;
+	int afd, tmo, t, rc, v6, ux;
+	short e0, e1;
+
+	/* host:port or [v6]:port. */
+	v6 = up[0] == '[';
+	snprintf(uaddr, sizeof(uaddr), "%s", up + v6);
+	if ((uport = strrchr(uaddr, v6 ? ']' : ':')) == NULL)
+		ERRX("WS_RELAY must be host:port");
+	*uport++ = 0;
+	if (v6 && *uport++ != ':')
+		ERRX("WS_RELAY must be host:port");
+
+	/* The upstream's Host header is built like the destination's one,
+	 * a Unix socket upstream is localhost:port to its server. */
+	ux = strncmp(uaddr, "unix:", 5) == 0;
+	v6 = !ux && strchr(uaddr, ':') != NULL;
+	t = atoi(uport) != 80;
+	snprintf(uhost, sizeof(uhost), "%s%s%s%s%s", v6 ? "[" : "",
+			ux ? "localhost" : uaddr, v6 ? "]" : "",
+			t ? ":": "", t ? uport : "");
+	up = uhost;
+
+	listen_all(addr, port);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((fds = realloc(fds, (nlfds + (1 + INET_RACE_MAX) * n) *
+						sizeof(*fds))) == NULL)
+			ERR("realloc()");
+
+		for (k = 0; k < (size_t)nlfds; k++) {
+			fds[k].fd = lfds[k];
+			fds[k].events = POLLIN;
+		}
+
+		/* Pending handshakes and connects bound the wait. */
+		tmo = -1;
+		for (i = 0; i < n; i++) {
+			r = rs[i];
+			r->pi = k;
+			for (j = 0; j < 2; j++) {
+				if (r->fd[j] >= 0) {
+					fds[k].fd = r->fd[j];
+					fds[k++].events = r->ev[j];
+				}
+				if (r->fd[j] >= 0 && !r->hs[j] &&
+				    (t = ws_handshake_timeout(&r->ws[j])) >= 0 &&
+				    (tmo < 0 || t < tmo))
+					tmo = t;
+			}
+			if (r->fd[1] < 0) {
+				k += inet_race_fds(&r->race, fds + k, &t);
+				if (t >= 0 && (tmo < 0 || t < tmo))
+					tmo = t;
+			}
+			r->pn = k - r->pi;
+		}
+
+		rc = poll(fds, k, tmo);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc < 0)
+			ERR("poll()");
+
+		for (i = m = 0; i < n; i++) {
+			r = rs[i];
+			for (e0 = 0, j = 0; j < r->pn; j++)
+				e0 |= fds[r->pi + j].revents;
+			e1 = r->fd[1] >= 0 ? fds[r->pi + 1].revents : 0;
+
+			if (!e0 && r->hs[0] && r->hs[1]) {
+				rs[m++] = r;
+				continue;
+			}
+
+			e0 = fds[r->pi].revents;
+			/* A hangup nobody reads would wake poll() forever. */
+			if (EV_ERR(e0 | e1) ||
+			    ((e0 & POLLHUP) && !(r->ev[0] & POLLIN)) ||
+			    ((e1 & POLLHUP) && !(r->ev[1] & POLLIN)))
+				rc = WS_E_EOF;
+			else
+				rc = relay_io(r, host, up, uri);
+			if (rc)
+				relay_free(r, rc);
+			else
+				rs[m++] = r;
+		}
+		n = m;
+
+		for (k = 0; k < (size_t)nlfds; k++) {
+			if (!EV_IN(fds[k].revents))
+				continue;
+			/* Everyone waiting gets in on one wakeup. */
+			while ((afd = accept_nb(lfds[k])) >= 0) {
+				if (n == cap) {
+					cap = cap ? 2 * cap : 16;
+					rs = realloc(rs, cap * sizeof(*rs));
+					if (rs == NULL)
+						ERR("realloc()");
+				}
+				if ((r = relay_new(afd, uaddr, uport)) == NULL)
+					continue;
+				if ((rc = relay_io(r, host, up, uri))) {
+					relay_free(r, rc);
+					continue;
+				}
+				rs[n++] = r;
+			}
+			if (!SOFT_ERROR)
+				WARN("accept()");
+		}
+	}
+}
+
+/* A connection of the echo or the broadcast server. */
+struct echo {
+	int		fd;
+	WebSocket	ws;
+	ws_serial	*s;
+	ws_frame	f;
+	unsigned long	id;
+	unsigned char	hs;
+	/* The peer's close came, answer once the replies are out. */
+	unsigned char	closing;
+	/* A pong (or the close) waiting for room in the socket. */
+	unsigned char	cop;
+	unsigned char	cbuf[125];
+	size_t		cn;
+	int		err;
+	short		ev;
+};
+
+struct echo_conns {
+	struct echo	**a;
+	size_t		n;
+	/* Where the last one was found, replies come in runs. */
+	size_t		last;
+};
+
+/* The reply is the message itself. A real handler parses and looks up
+ * things here, on a worker, while the loop goes on, and sends whatever
+ * and whenever it wants through the inbox. */
+static void echo_work(void *arg, ws_pmsg *m)
+{
+	ws_inbox_send(arg, ws_serial_id(m->s), m->txt, m->buf, m->n);
+}
+
+static WebSocket *echo_conn(void *arg, unsigned long id)
+{
+	struct echo_conns *c = arg;
+	size_t i;
+
+	for (i = 0; i < c->n; i++, c->last++) {
+		if (c->last >= c->n)
+			c->last = 0;
+		if (c->a[c->last]->id == id)
+			return &c->a[c->last]->ws;
+	}
+
+	return NULL;
+}
+
+static struct echo *echo_new(int afd, ws_pool *p, ws_cq *q)
+{
+	struct echo *e;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		close(afd);
+		return NULL;
+	}
+
+	e->fd = afd;
+	if (ws_init(&e->ws, 1) < 0) {
+		close(afd);
+		free(e);
+		return NULL;
+	}
+	if (p && (e->s = ws_serial_new(p, q, e, NULL)) == NULL) {
+		ws_deinit(&e->ws);
+		close(afd);
+		free(e);
+		return NULL;
+	}
+
+	e->id = e->s ? ws_serial_id(e->s) : 0;
+	ws_set_bio(&e->ws, &e->fd, socksend, sockrecv);
+	ws_set_bio_cork(&e->ws, sockcork);
+	ws_limits(&e->ws);
+
+	return e;
+}
+
+static void echo_free(struct echo *e)
+{
+	if (e->s)
+		ws_serial_free(e->s);
+	ws_deinit(&e->ws);
+	close(e->fd);
+	free(e);
+}
+
+/* 0 while the connection is alive, 1 when it's closed or < 0. */
+static int echo_io(struct echo *e, const char *host, const char *uri)
+{
+	int rc;
+
+	e->ev = 0;
+	if (e->err)
+		return e->err;
+
+	if (!e->hs) {
+		rc = ws_handshake(&e->ws, host, uri, NULL);
+		if (rc == WS_E_WANT_READ || rc == WS_E_WANT_WRITE) {
+			e->ev = rc == WS_E_WANT_READ ? POLLIN : POLLOUT;
+			return 0;
+		}
+		if (rc)
+			return rc;
+		e->hs = 1;
+	}
+
+	/* The workers are behind, let the socket buffer fill up. Without
+	 * them the data is dropped. */
+	while (!e->cop && !e->closing &&
+	       (!e->s || ws_serial_pending(e->s) < ECHO_PENDING)) {
+		rc = e->s ? ws_serial_parse(e->s, &e->ws, &e->f) :
+			    ws_read_frame(&e->ws, &e->f);
+		if (rc == WS_E_WANT_READ) {
+			e->ev |= POLLIN;
+			break;
+		} else if (rc)
+			return rc;
+
+		if (e->f.op == WS_OP_PING) {
+			e->cop = WS_OP_PING;
+			e->cn = e->f.n;
+			memcpy(e->cbuf, e->f.buf, e->f.n);
+		} else if (e->f.op == WS_OP_CLOSE)
+			e->closing = 1;
+	}
+
+	if ((rc = ws_flush(&e->ws)) == WS_E_WANT_WRITE) {
+		e->ev |= POLLOUT;
+		return 0;
+	} else if (rc)
+		return rc;
+
+	/* Control frames are repeated till they are out. */
+	if (e->cop == WS_OP_PING) {
+		rc = ws_pong(&e->ws, e->cbuf, e->cn);
+		if (rc == WS_E_WANT_WRITE) {
+			e->ev |= POLLOUT;
+			return 0;
+		} else if (rc)
+			return rc;
+		e->cop = 0;
+		return echo_io(e, host, uri);
+	}
+
+	if (!e->closing)
+		return 0;
+	if ((e->s && ws_serial_pending(e->s) > 0) || ws_queued(&e->ws) > 0)
+		return 0;
+	rc = ws_close(&e->ws, 1000, NULL, 0);
+	if (rc == WS_E_WANT_WRITE) {
+		e->ev |= POLLOUT;
+		return 0;
+	}
+
+	return rc ? rc : 1;
+}
+
+/* Many connections on one poll() loop, their messages are handled on
+ * a work-stealing pool which sends the replies through an inbox. */
+static void echo(const char *addr, const char *port,
+			const char *host, const char *uri)
+{
+	struct echo **es = NULL, *e;
+	struct echo_conns c = { 0 };
+	struct pollfd *fds = NULL;
+	size_t n = 0, cap = 0, k, i, m;
+	ws_inbox *ib;
+	ws_pool *p;
+	ws_cq *q;
+	int afd, tmo, t, rc;
+
+	if ((ib = ws_inbox_new()) == NULL ||
+	    (p = ws_pool_new(atoi(getenv("WS_ECHO")), echo_work,
+			     ib)) == NULL || (q = ws_cq_new()) == NULL)
+		ERRX("ws_pool_new() failed");
+
+	listen_all(addr, port);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((fds = realloc(fds, (nlfds + 2 + n) *
+						sizeof(*fds))) == NULL)
+			ERR("realloc()");
+
+		for (k = 0; k < (size_t)nlfds; k++) {
+			fds[k].fd = lfds[k];
+			fds[k].events = POLLIN;
+		}
+		fds[k].fd = ws_cq_fd(q);
+		fds[k++].events = POLLIN;
+		fds[k].fd = ws_inbox_fd(ib);
+		fds[k++].events = POLLIN;
+
+		tmo = -1;
+		for (i = 0; i < n; i++, k++) {
+			fds[k].fd = es[i]->fd;
+			fds[k].events = es[i]->ev;
+			if (!es[i]->hs &&
+			    (t = ws_handshake_timeout(&es[i]->ws)) >= 0 &&
+			    (tmo < 0 || t < tmo))
+				tmo = t;
+		}
+
+		rc = poll(fds, k, tmo);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc < 0)
+			ERR("poll()");
+
+		/* Replies first, they may unblock reading. A handler sends
+		 * before it's done, so whatever is done has been sent. */
+		if (fds[nlfds].revents || fds[nlfds + 1].revents) {
+			ws_cq_run(q);
+			c.a = es;
+			c.n = n;
+			ws_inbox_run(ib, echo_conn, &c);
+		}
+
+		for (i = m = 0; i < n; i++) {
+			e = es[i];
+			t = fds[nlfds + 2 + i].revents;
+			if (EV_ERR(t) || ((t & POLLHUP) && !(e->ev & POLLIN)))
+				rc = WS_E_EOF;
+			else
+				rc = echo_io(e, host, uri);
+			if (rc)
+				echo_free(e);
+			else
+				es[m++] = e;
+		}
+		n = m;
+
+		for (k = 0; k < (size_t)nlfds; k++) {
+			if (!EV_IN(fds[k].revents))
+				continue;
+			while ((afd = accept_nb(lfds[k])) >= 0) {
+				if (n == cap) {
+					cap = cap ? 2 * cap : 16;
+					es = realloc(es, cap * sizeof(*es));
+					if (es == NULL)
+						ERR("realloc()");
+				}
+				if ((e = echo_new(afd, p, q)) == NULL)
+					continue;
+				if ((rc = echo_io(e, host, uri))) {
+					echo_free(e);
+					continue;
+				}
+				es[n++] = e;
+			}
+			if (!SOFT_ERROR)
+				WARN("accept()");
+		}
+	}
+}
+
+/* A loop of the broadcast server, it gets its connections from the
+ * accepting thread and the messages from the publisher. */
+struct bshard {
+	ws_bcast	*b;
+	int		i;
+	int		fd[2];
+	const char	*host;
+	const char	*uri;
+	pthread_t	t;
+};
+
+static void bcast_each(void *arg, ws_bmsg *m)
+{
+	struct echo_conns *c = arg;
+	ssize_t rc;
+	size_t i;
+
+	for (i = 0; i < c->n; i++) {
+		if (!c->a[i]->hs || c->a[i]->closing || c->a[i]->err)
+			continue;
+		/* Too far behind, the client has to reconnect. */
+		if ((rc = ws_bcast_queue(&c->a[i]->ws, m)) < 0) {
+			WARNX("client %d: dropped -0x%zX", c->a[i]->fd, -rc);
+			c->a[i]->err = (int)rc;
+		}
+	}
+}
+
+static void *bcast_shard(void *arg)
+{
+	struct bshard *sh = arg;
+	struct echo **es = NULL, *e;
+	struct echo_conns c = { 0 };
+	struct pollfd *fds = NULL;
+	size_t n = 0, cap = 0, lost, k, i, m;
+	int afd, tmo, t, rc, done = 0;
+	ssize_t r;
+
+	while (!done || n > 0) {
+		if ((fds = realloc(fds, (2 + n) * sizeof(*fds))) == NULL)
+			ERR("realloc()");
+
+		fds[0].fd = done ? -1 : sh->fd[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = ws_bcast_fd(sh->b, sh->i);
+		fds[1].events = POLLIN;
+
+		tmo = -1;
+		for (i = 0, k = 2; i < n; i++, k++) {
+			fds[k].fd = es[i]->fd;
+			fds[k].events = es[i]->ev;
+			if (!es[i]->hs &&
+			    (t = ws_handshake_timeout(&es[i]->ws)) >= 0 &&
+			    (tmo < 0 || t < tmo))
+				tmo = t;
+		}
+
+		rc = poll(fds, k, tmo);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc < 0)
+			ERR("poll()");
+
+		while (EV_IN(fds[0].revents) &&
+		       (r = read(sh->fd[0], &afd, sizeof(afd))) != -1) {
+			/* The publisher is gone. */
+			if (r != sizeof(afd)) {
+				done = 1;
+				break;
+			}
+			if (n == cap) {
+				cap = cap ? 2 * cap : 16;
+				if ((es = realloc(es, cap * sizeof(*es))) == NULL)
+					ERR("realloc()");
+			}
+			if ((e = echo_new(afd, NULL, NULL)) == NULL)
+				continue;
+			ws_set_queue_limit(&e->ws, BCAST_QUEUE);
+			es[n++] = e;
+		}
+
+		if (fds[1].revents || done) {
+			c.a = es;
+			c.n = n;
+			ws_bcast_run(sh->b, sh->i, bcast_each, &c);
+			if ((lost = ws_bcast_lost(sh->b, sh->i)) > 0)
+				WARNX("shard %d: lost %zu messages",
+				      sh->i, lost);
+		}
+
+		/* Everything is queued, close once it's out. */
+		for (i = 0; done && i < n; i++)
+			es[i]->closing = 1;
+
+		for (i = m = 0; i < n; i++) {
+			e = es[i];
+			t = i + 2 < k ? fds[2 + i].revents : 0;
+			if (EV_ERR(t) || ((t & POLLHUP) && !(e->ev & POLLIN)))
+				rc = WS_E_EOF;
+			else
+				rc = echo_io(e, sh->host, sh->uri);
+			if (rc)
+				echo_free(e);
+			else
+				es[m++] = e;
+		}
+		n = m;
+	}
+
+	free(es);
+	free(fds);
+
+	return NULL;
+}
+
+/* Standard input goes to every client, the clients are spread over
+ * the shards' threads. */
+static void bcast(const char *addr, const char *port,
+			const char *host, const char *uri)
+{
+	static unsigned char buf[STAGE_SIZE];
+	struct pollfd fds[LISTEN_MAX + 1];
+	struct bshard *sh;
+	sigset_t all, old;
+	unsigned int rr = 0;
+	ws_bcast *b;
+	int i, k, n, afd;
+	long cpus;
+	ssize_t r;
+
+	if ((n = atoi(getenv("WS_BCAST"))) <= 0)
+		n = (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (int)cpus : 1;
+
+	if ((b = ws_bcast_new(n, BCAST_SLOTS)) == NULL ||
+	    (sh = calloc(n, sizeof(*sh))) == NULL)
+		ERRX("ws_bcast_new() failed");
+
+	listen_all(addr, port);
+	signal(SIGPIPE, SIG_IGN);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < n; i++) {
+		sh[i].b = b;
+		sh[i].i = i;
+		sh[i].host = host;
+		sh[i].uri = uri;
+		if (pipe(sh[i].fd) < 0 || fd_nonblock(sh[i].fd[0]) < 0)
+			ERR("pipe()");
+		if ((errno = pthread_create(&sh[i].t, NULL, bcast_shard,
+					    &sh[i])))
+			ERR("pthread_create()");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	for (;;) {
+		for (k = 0; k < nlfds; k++) {
+			fds[k].fd = lfds[k];
+			fds[k].events = POLLIN;
+		}
+		fds[k].fd = STDIN_FILENO;
+		fds[k++].events = POLLIN;
+
+		if (poll(fds, k, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("poll()");
+		}
+
+		if (EV_IN(fds[nlfds].revents)) {
+			r = read(STDIN_FILENO, buf, sizeof(buf));
+			if (r > 0)
+				ws_bcast_publish(b, 0, buf, r);
+			else if (r == 0 || !SOFT_ERROR)
+				break;
+		}
+
+		for (k = 0; k < nlfds; k++) {
+			if (!EV_IN(fds[k].revents))
+				continue;
+			while ((afd = accept_nb(lfds[k])) >= 0)
+				if (write(sh[rr++ % n].fd[1], &afd,
+					  sizeof(afd)) != sizeof(afd))
+					close(afd);
+			if (!SOFT_ERROR)
+				WARN("accept()");
+		}
+	}
+
+	/* The shards send what they have, close and go. */
+	for (i = 0; i < n; i++)
+		close(sh[i].fd[1]);
+	for (i = 0; i < n; i++) {
+		pthread_join(sh[i].t, NULL);
+		close(sh[i].fd[0]);
+	}
+	ws_bcast_free(b);
+	free(sh);
+}
+
+/* A connection of WS_REPLAY. */
+struct play {
+	int		fd;
+	WebSocket	ws;
+	unsigned char	hs;
+	/* The close went out, the server's one is awaited. */
+	unsigned char	closed;
+	/* The record is half sent, it's repeated till it's out. */
+	unsigned char	sending;
+	/* A pong or the close answering the server's one. */
+	unsigned char	cop;
+	unsigned char	cbuf[125];
+	size_t		cn;
+	short		ev;
+	/* The next record and the one due. */
+	size_t		off;
+	const struct ws_cap_rec *r;
+	long long	start;
+	long long	due;
+	/* When the requests the server answered in the capture went out,
+	 * the answers come in order. */
+	long long	*asked;
+	size_t		nasked;
+	size_t		capasked;
+	size_t		answered;
+	unsigned long long frames[2];
+	unsigned long long bytes[2];
+};
+
+struct replay {
+	const struct ws_cap_hdr *h;
+	size_t		len;
+	/* The client's frames. */
+	int		dir;
+	uint64_t	t0;
+	double		speed;
+	long long	*lat;
+	size_t		nlat;
+	size_t		caplat;
+};
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The server's next data frame after the one at off is its answer. */
+static int play_answered(const struct replay *rp, size_t off)
+{
+	const struct ws_cap_rec *r;
+
+	while ((r = ws_cap_next(rp->h, rp->len, &off)) != NULL)
+		if (!(r->b0 & 0x08))
+			return r->dir != rp->dir;
+
+	return 0;
+}
+
+static void ll_push(long long **a, size_t *n, size_t *cap, long long v)
+{
+	long long *p;
+
+	if (*n == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		if ((p = realloc(*a, *cap * sizeof(*p))) == NULL)
+			ERR("realloc()");
+		*a = p;
+	}
+	(*a)[(*n)++] = v;
+}
+
+static int play_send(struct play *pl, const struct ws_cap_rec *r)
+{
+	const unsigned char *p = (const void *)(r + 1);
+	ws_frame f;
+
+	switch (r->b0 & 0x0F) {
+	case WS_OP_CLOSE:
+		if (r->n < 2)
+			return ws_close(&pl->ws, 1000, NULL, 0);
+		return ws_close(&pl->ws, p[0] << 8 | p[1], p + 2, r->n - 2);
+	case WS_OP_PING:
+		return ws_ping(&pl->ws, p, r->n);
+	}
+
+	memset(&f, 0, sizeof(f));
+	f.fin = r->b0 >> 7;
+	f.rsv = (r->b0 >> 4) & 0x07;
+	f.op = r->b0 & 0x0F;
+	f.len = f.n = r->n;
+	f.buf = p;
+
+	return ws_write_frame(&pl->ws, &f);
+}
+
+/* 0 while the connection is alive, 1 when it's done or < 0. */
+static int play_io(struct play *pl, struct replay *rp,
+		   const char *host, const char *uri)
+{
+	const struct ws_cap_rec *r;
+	long long t = now_ns();
+	ws_frame f;
+	int rc;
+
+	pl->ev = 0;
+	pl->due = -1;
+
+	if (!pl->hs) {
+		rc = ws_handshake(&pl->ws, host, uri, NULL);
+		if (rc == WS_E_WANT_READ || rc == WS_E_WANT_WRITE) {
+			pl->ev = rc == WS_E_WANT_READ ? POLLIN : POLLOUT;
+			return 0;
+		}
+		if (rc)
+			return rc;
+		pl->hs = 1;
+		pl->start = t;
+	}
+
+	while (!pl->cop) {
+		rc = ws_read_frame(&pl->ws, &f);
+		if (rc == WS_E_WANT_READ) {
+			pl->ev |= POLLIN;
+			break;
+		} else if (rc)
+			return rc;
+
+		pl->frames[0] += f.off == 0;
+		pl->bytes[0] += f.n;
+		if (f.op == WS_OP_PING) {
+			pl->cop = WS_OP_PING;
+			pl->cn = f.n;
+			memcpy(pl->cbuf, f.buf, f.n);
+		} else if (f.op == WS_OP_CLOSE) {
+			if (pl->closed)
+				return 1;
+			pl->cop = WS_OP_CLOSE;
+		} else if (f.fin && f.off + f.n >= f.len &&
+			   pl->answered < pl->nasked) {
+			ll_push(&rp->lat, &rp->nlat, &rp->caplat,
+				t - pl->asked[pl->answered++]);
+			if (pl->answered == pl->nasked)
+				pl->answered = pl->nasked = 0;
+		}
+	}
+
+	/* Control frames are repeated till they are out. */
+	if (pl->cop) {
+		rc = pl->cop == WS_OP_PING ?
+		     ws_pong(&pl->ws, pl->cbuf, pl->cn) :
+		     ws_close(&pl->ws, 1000, NULL, 0);
+		if (rc == WS_E_WANT_WRITE) {
+			pl->ev |= POLLOUT;
+			return 0;
+		} else if (rc)
+			return rc;
+		if (pl->cop == WS_OP_CLOSE)
+			return 1;
+		pl->cop = 0;
+		return play_io(pl, rp, host, uri);
+	}
+
+	while (!pl->closed) {
+		/* The pongs answered the recorded pings, the live ones are
+		 * answered above. */
+		while (!pl->r && (r = ws_cap_next(rp->h, rp->len,
+						  &pl->off)) != NULL)
+			if (r->dir == rp->dir &&
+			    (r->b0 & 0x0F) != WS_OP_PONG)
+				pl->r = r;
+
+		if ((r = pl->r) == NULL) {
+			rc = ws_close(&pl->ws, 1000, NULL, 0);
+		} else if (!pl->sending && rp->speed > 0 &&
+			   (pl->due = pl->start + (long long)((r->t - rp->t0) /
+							       rp->speed)) > t) {
+			break;
+		} else
+			rc = play_send(pl, r);
+
+		if (rc == WS_E_WANT_WRITE) {
+			pl->sending = 1;
+			pl->ev |= POLLOUT;
+			break;
+		} else if (rc)
+			return rc;
+
+		pl->sending = 0;
+		pl->due = -1;
+		pl->r = NULL;
+		if (r == NULL || (r->b0 & 0x0F) == WS_OP_CLOSE) {
+			pl->closed = 1;
+			break;
+		}
+		pl->frames[1]++;
+		pl->bytes[1] += r->n;
+		if (!(r->b0 & 0x08) && (r->b0 & 0x80) &&
+		    play_answered(rp, pl->off))
+			ll_push(&pl->asked, &pl->nasked, &pl->capasked, t);
+	}
+
+	return 0;
+}
+
+/* Plays the client's frames of a capture to the server over many
+ * connections at once, timed as they were, scaled or as fast as the
+ * server takes them. */
+static void replay(const char *addr, const char *port,
+			const char *host, const char *uri)
+{
+	const char *conns = getenv("WS_REPLAY_CONNS");
+	const char *speed = getenv("WS_REPLAY_SPEED");
+	unsigned long long frames[2] = { 0 }, bytes[2] = { 0 };
+	const struct ws_cap_rec *r;
+	struct replay rp = { 0 };
+	struct pollfd *fds;
+	struct play *ps;
+	size_t off = 0;
+	long long start, t, due;
+	int i, n, live, failed = 0, tmo, rc;
+	double s;
+
+	if ((rp.h = ws_cap_map(getenv("WS_REPLAY"), &rp.len)) == NULL)
+		ERRX("WS_REPLAY: %s is not a capture", getenv("WS_REPLAY"));
+	rp.dir = rp.h->srv ? WS_CAP_IN : WS_CAP_OUT;
+	if ((r = ws_cap_next(rp.h, rp.len, &off)) != NULL)
+		rp.t0 = r->t;
+	rp.speed = speed ? atof(speed) : 1;
+	n = conns && atoi(conns) > 0 ? atoi(conns) : 1;
+
+	if ((ps = calloc(n, sizeof(*ps))) == NULL ||
+	    (fds = calloc(n, sizeof(*fds))) == NULL)
+		ERR("calloc()");
+
+	signal(SIGPIPE, SIG_IGN);
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if ((ps[i].fd = tcp_connect(addr, port, fd_nonblock)) < 0)
+			ERR("tcp_connect() failed");
+		if (ws_init(&ps[i].ws, 0) < 0)
+			ERRX("ws_init() failed");
+		ws_set_bio(&ps[i].ws, &ps[i].fd, socksend, sockrecv);
+		ws_set_bio_cork(&ps[i].ws, sockcork);
+		ws_limits(&ps[i].ws);
+		/* Connecting. */
+		ps[i].ev = POLLOUT;
+	}
+
+	for (live = n; live > 0; ) {
+		t = now_ns();
+		tmo = -1;
+		for (i = 0; i < n; i++) {
+			fds[i].fd = ps[i].fd;
+			fds[i].events = ps[i].ev;
+			if (ps[i].fd < 0 || (due = ps[i].due) < 0)
+				continue;
+			due = due > t ? (due - t + 999999) / 1000000 : 0;
+			if (tmo < 0 || due < tmo)
+				tmo = due;
+		}
+
+		rc = poll(fds, n, tmo);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc < 0)
+			ERR("poll()");
+
+		for (i = 0; i < n; i++) {
+			if (ps[i].fd < 0)
+				continue;
+			if (EV_ERR(fds[i].revents))
+				rc = WS_E_IO;
+			else
+				rc = play_io(&ps[i], &rp, host, uri);
+			if (rc == 0)
+				continue;
+
+			if (rc < 0) {
+				WARNX("replay %d: failed -0x%X", i, -rc);
+				failed++;
+			}
+			frames[0] += ps[i].frames[0];
+			frames[1] += ps[i].frames[1];
+			bytes[0] += ps[i].bytes[0];
+			bytes[1] += ps[i].bytes[1];
+			ws_deinit(&ps[i].ws);
+			close(ps[i].fd);
+			free(ps[i].asked);
+			ps[i].fd = -1;
+			live--;
+		}
+	}
+
+	s = (now_ns() - start) / 1e9;
+	WARNX("replay: %d conns (%d failed), out %llu frames %llu B, "
+	      "in %llu frames %llu B, %.3f s, %.2f MB/s",
+	      n, failed, frames[1], bytes[1], frames[0], bytes[0], s,
+	      s > 0 ? (bytes[0] + bytes[1]) / s / 1e6 : 0.0);
+	if (rp.nlat > 0) {
+		qsort(rp.lat, rp.nlat, sizeof(*rp.lat), cmp_ll);
+		WARNX("replay: %zu answers, p50 %.1f us, p99 %.1f us, "
+		      "max %.1f us", rp.nlat, rp.lat[rp.nlat / 2] / 1e3,
+		      rp.lat[rp.nlat * 99 / 100] / 1e3,
+		      rp.lat[rp.nlat - 1] / 1e3);
+	}
+
+	free(rp.lat);
+	free(fds);
+	free(ps);
+	ws_cap_unmap(rp.h, rp.len);
+}
+
+static void usr(const char *addr, const char *port,
+		const char *host, const char *uri)
+{
+	WebSocket ws;
+	int fd;
+
+	if ((fd = tcp_connect(addr, port, fd_nonblock)) < 0)
+		ERR("tcp_connect() failed");
+
+	if (ws_init(&ws, 0) < 0)
+		ERRX("ws_init() failed");
+
+	wscat_run(&ws, fd, STDIN_FILENO, STDOUT_FILENO, host, uri);
 
 	ws_deinit(&ws);
 	close(fd);
@@ -470,19 +2447,83 @@ static void usage(void)
 {
 	extern const char *const __progname;
 	fprintf(stderr,
-		"\nusage: [WS_SRV=] [WS_URI=/uri] %s dest port\n\n"
-		"    WS_SRV and WS_URI are environment variables:\n"
+		"\nusage: [WS_SRV=] [WS_URI=/uri] [WS_EXEC=cmd [WS_POOL=n]] "
+		"[WS_FRAG=size|auto] [WS_SPLICE=]\n"
+		"       [WS_TLS=] [WS_CERT=pem [WS_KEY=pem]] [WS_CA=pem] "
+		"[WS_KTLS=] [WS_RELAY=host:port]\n"
+		"       [WS_HS_TIMEOUT=ms] [WS_HS_MAX=bytes] [WS_HS_CONNS=n] "
+		"[WS_MEM=bytes] [WS_CONNS=n]\n"
+		"       [WS_BUF_MIN=bytes] [WS_BUF_MAX=bytes] [WS_DNS_TTL=ms] "
+		"[WS_UNIX=path|@name]\n"
+		"       [WS_TUNE=latency|throughput] [WS_KEEPALIVE=s] "
+		"[WS_USER_TIMEOUT=ms] [WS_FASTOPEN=[qlen]]\n"
+		"       [WS_ECHO=n] [WS_BCAST=n] [WS_RECORD=file] "
+		"[WS_REPLAY=file [WS_REPLAY_CONNS=n]\n"
+		"       [WS_REPLAY_SPEED=x]] [WS_PING=ms] [WS_PING_MISS=n]\n"
+		"       %s dest|unix:path|unix:@name port\n\n"
+		"    WS_* are environment variables:\n"
 		"    * WS_SRV starts the program as a server.\n"
 		"    * WS_URI sets ws://dest:port/URI, default is '%s'.\n"
-		"\n", __progname, DEFAULT_URI);
+		"    * WS_EXEC starts a server which binds every connection\n"
+		"      to stdin/stdout of its own 'sh -c cmd'.\n"
+		"    * WS_RELAY starts a server which passes frames between\n"
+		"      every client and its own connection to host:port.\n"
+		"    * WS_ECHO starts an echo server which handles the\n"
+		"      messages on n threads, 0 is one per CPU.\n"
+		"    * WS_BCAST starts a server which sends its standard\n"
+		"      input to every client, the clients are spread over\n"
+		"      n threads, 0 is one per CPU.\n"
+		"    * WS_RECORD writes the frames of the session both ways\n"
+		"      to a capture file (file.pid for WS_EXEC).\n"
+		"    * WS_REPLAY plays the client's frames of a capture to\n"
+		"      the server over WS_REPLAY_CONNS connections, x times\n"
+		"      as fast as recorded (0 is as fast as it goes), and\n"
+		"      reports the throughput and the answers' latency.\n"
+		"    * WS_POOL sets the number of pre-forked WS_EXEC workers,\n"
+		"      default is %d.\n"
+		"    * WS_FRAG sends messages longer than size as fragments,\n"
+		"      'auto' sizes them by the socket's free send buffer.\n"
+		"    * WS_SPLICE puts binary payloads to stdout with splice(2).\n"
+		"    * WS_TLS makes the client use wss://, WS_CA verifies\n"
+		"      the server with the given CA instead of the system ones.\n"
+		"    * WS_CERT and WS_KEY make the server use wss://.\n"
+		"    * WS_KTLS passes the TLS keys to the kernel (kTLS).\n"
+		"    * WS_HS_TIMEOUT limits the handshake time, default is %d,\n"
+		"      0 waits forever.\n"
+		"    * WS_HS_MAX limits the HTTP header size, default is %d.\n"
+		"    * WS_HS_CONNS answers 503 when that many WS_EXEC\n"
+		"      handshakes are already in progress.\n"
+		"    * WS_MEM and WS_CONNS limit the memory and connections\n"
+		"      of all WS_EXEC workers, new connections get 503.\n"
+		"    * WS_BUF_MIN and WS_BUF_MAX let the buffers adapt to the\n"
+		"      traffic between the sizes, default is %d for both.\n"
+		"    * WS_DNS_TTL caches the WS_RELAY host's addresses for\n"
+		"      that long, default is %d, 0 resolves every time.\n"
+		"    * WS_UNIX makes a server listen on the Unix socket too,\n"
+		"      its clients are as if they came to localhost:port.\n"
+		"    * WS_TUNE sets TCP_NODELAY, TCP_QUICKACK and a small\n"
+		"      TCP_NOTSENT_LOWAT for latency, or 4 MiB socket buffers\n"
+		"      and TCP_CORK around queue flushes for throughput.\n"
+		"    * WS_KEEPALIVE probes a connection idle for that many\n"
+		"      seconds, WS_USER_TIMEOUT drops one whose data stays\n"
+		"      unacknowledged for that many ms.\n"
+		"    * WS_FASTOPEN sends the upgrade request in the SYN\n"
+		"      (TCP Fast Open), a server accepts that many such\n"
+		"      pending connections, default is %d.\n"
+		"    * WS_PING pings the peer every that many ms, default\n"
+		"      is %d, 0 never, SIGUSR1 and the exit print the\n"
+		"      round trip times. WS_PING_MISS tolerates that many\n"
+		"      unanswered pings in a row, default is 0.\n"
+		"\n", __progname, DEFAULT_URI, POOL_SIZE, HS_TIMEOUT, HS_MAX,
+		WS_BUF_SIZE, INET_DNS_TTL, FASTOPEN_QLEN, PING_TIMEOUT * 1000);
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
 	char host[1024];
-	char *addr, *port, *uri;
-	int n;
+	char *addr, *port, *uri, *ttl;
+	int n, v6, ux;
 
 	if (argc < 3)
 		usage();
@@ -495,15 +2536,29 @@ int main(int argc, char *argv[])
 	if ((n = atoi(port)) <= 0 || n > 65535)
 		usage();
 
-	snprintf(host, sizeof(host), "%s%s%s", addr,
+	/* An IPv6 literal is bracketed in the Host header, a Unix socket
+	 * goes for localhost. */
+	ux = strncmp(addr, "unix:", 5) == 0;
+	v6 = !ux && strchr(addr, ':') != NULL;
+	snprintf(host, sizeof(host), "%s%s%s%s%s", v6 ? "[" : "",
+			ux ? "localhost" : addr, v6 ? "]" : "",
 			n != 80 ? ":": "", n != 80 ? port : "");
 
 	uri = (uri = getenv("WS_URI")) ? uri : DEFAULT_URI;
 
+	if ((ttl = getenv("WS_DNS_TTL")))
+		inet_dns_ttl(atoi(ttl));
+	sock_tune();
+
 	if (fd_nonblock(STDIN_FILENO) < 0)
 		ERR("fd_nonblock() failed");
 
-	(getenv("WS_SRV") ? srv : usr)(addr, port, host, uri);
+	(getenv("WS_RELAY") ? relay :
+	 getenv("WS_REPLAY") ? replay :
+	 getenv("WS_ECHO")  ? echo :
+	 getenv("WS_BCAST") ? bcast :
+	 getenv("WS_EXEC") ? srv_exec :
+	 getenv("WS_SRV")  ? srv : usr)(addr, port, host, uri);
 
 	return EXIT_SUCCESS;
 }